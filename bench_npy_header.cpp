@@ -0,0 +1,93 @@
+//Microbenchmark for npy header parsing and building, and small-file npy_load latency.
+//usage: bench_npy_header [nfiles] [directory]
+
+#include"cnpy.h"
+#include<chrono>
+#include<cstdio>
+#include<cstdlib>
+#include<regex>
+#include<string>
+#include<vector>
+
+//the regex based parser cnpy used before, kept here as the baseline
+static void parse_npy_header_regex(unsigned char* buffer, size_t& word_size, std::vector<size_t>& shape, bool& fortran_order) {
+    uint16_t header_len = *reinterpret_cast<uint16_t*>(buffer+8);
+    std::string header(reinterpret_cast<char*>(buffer+9),header_len);
+
+    size_t loc1 = header.find("fortran_order")+16;
+    fortran_order = (header.substr(loc1,4) == "True" ? true : false);
+
+    loc1 = header.find("(");
+    size_t loc2 = header.find(")");
+
+    std::regex num_regex("[0-9][0-9]*");
+    std::smatch sm;
+    shape.clear();
+
+    std::string str_shape = header.substr(loc1+1,loc2-loc1-1);
+    while(std::regex_search(str_shape, sm, num_regex)) {
+        shape.push_back(std::stoull(sm[0].str()));
+        str_shape = sm.suffix().str();
+    }
+
+    loc1 = header.find("descr")+9;
+    std::string str_ws = header.substr(loc1+2);
+    loc2 = str_ws.find("'");
+    word_size = atoi(str_ws.substr(0,loc2).c_str());
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv)
+{
+    size_t nfiles = argc > 1 ? strtoul(argv[1],NULL,10) : 10000;
+    std::string dir = argc > 2 ? argv[2] : ".";
+
+    std::vector<char> header = cnpy::create_npy_header<double>({16,4,2});
+    const size_t nparse = 200000;
+    size_t word_size;
+    std::vector<size_t> shape;
+    bool fortran_order;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for(size_t i = 0;i < nparse;i++)
+        parse_npy_header_regex(reinterpret_cast<unsigned char*>(&header[0]),word_size,shape,fortran_order);
+    double regex_ns = seconds_since(start) / nparse * 1e9;
+
+    start = std::chrono::steady_clock::now();
+    for(size_t i = 0;i < nparse;i++)
+        cnpy::parse_npy_header(reinterpret_cast<unsigned char*>(&header[0]),word_size,shape,fortran_order);
+    double parse_ns = seconds_since(start) / nparse * 1e9;
+
+    std::vector<size_t> header_shape = {16,4,2};
+    size_t total_bytes = 0;
+    start = std::chrono::steady_clock::now();
+    for(size_t i = 0;i < nparse;i++) total_bytes += cnpy::create_npy_header<double>(header_shape).size();
+    double create_ns = seconds_since(start) / nparse * 1e9;
+
+    start = std::chrono::steady_clock::now();
+    for(size_t i = 0;i < nparse;i++) total_bytes += cnpy::npy_header_cached<double>(header_shape).size();
+    double cached_ns = seconds_since(start) / nparse * 1e9;
+
+    printf("parse_npy_header (regex baseline): %8.0f ns/header\n",regex_ns);
+    printf("parse_npy_header:                  %8.0f ns/header\n",parse_ns);
+    printf("create_npy_header:                 %8.0f ns/header\n",create_ns);
+    printf("npy_header_cached:                 %8.0f ns/header (%zu bytes)\n",cached_ns,total_bytes);
+
+    //many small files, as in a dataset of one array per event
+    std::vector<double> data(128,1.0);
+    std::vector<std::string> fnames;
+    for(size_t i = 0;i < nfiles;i++) {
+        fnames.push_back(dir+"/bench_npy_header_"+std::to_string(i)+".npy");
+        cnpy::npy_save(fnames.back(),&data[0],{16,4,2});
+    }
+
+    start = std::chrono::steady_clock::now();
+    for(size_t i = 0;i < nfiles;i++) cnpy::npy_load(fnames[i]);
+    double load_us = seconds_since(start) / nfiles * 1e6;
+    printf("npy_load of %zu small files:      %8.2f us/file (warm cache)\n",nfiles,load_us);
+
+    for(size_t i = 0;i < nfiles;i++) remove(fnames[i].c_str());
+}
@@ -10,7 +10,24 @@
 #include<iomanip>
 #include<stdint.h>
 #include<stdexcept>
-#include <regex>
+#include<atomic>
+#include<thread>
+#include<functional>
+#include<exception>
+#include<mutex>
+#include<condition_variable>
+#include<deque>
+#include<set>
+#include<future>
+#include<chrono>
+#include<cerrno>
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
+#ifdef CNPY_HAVE_ZSTD
+#include<zstd.h>
+#endif
 
 char cnpy::BigEndianTest() {
     int x = 1;
@@ -25,6 +42,7 @@ char cnpy::map_type(const std::type_info& t)
 
     if(t == typeid(int) ) return 'i';
     if(t == typeid(char) ) return 'i';
+    if(t == typeid(signed char) ) return 'i';
     if(t == typeid(short) ) return 'i';
     if(t == typeid(long) ) return 'i';
     if(t == typeid(long long) ) return 'i';
@@ -44,6 +62,63 @@ char cnpy::map_type(const std::type_info& t)
     else return '?';
 }
 
+size_t cnpy::write_npy_header(char* out, size_t capacity, const char* descr, size_t descr_len, const size_t* shape, size_t ndims,
+                              bool fortran_order, size_t header_size) {
+    //the shape digits, last axis first
+    char digits[20 * 64];
+    size_t ndigits[64];
+    if(ndims > 64) throw std::runtime_error("create_npy_header: more than 64 axes");
+    char* d = digits;
+    for(size_t i = 0;i < ndims;i++) {
+        size_t v = shape[i], n = 0;
+        do { d[n++] = (char) ('0' + v % 10); v /= 10; } while(v);
+        ndigits[i] = n;
+        d += n;
+    }
+
+    static const char key_descr[] = "{'descr': ";
+    static const char key_fortran[] = ", 'fortran_order': ";
+    static const char key_shape[] = ", 'shape': (";
+    static const char tail[] = "), }";
+    size_t dict_size = sizeof(key_descr)-1 + descr_len + sizeof(key_fortran)-1 + (fortran_order ? 4 : 5) + sizeof(key_shape)-1
+                       + (d - digits) + (ndims > 1 ? 2*(ndims-1) : 0) + (ndims == 1 ? 1 : 0) + sizeof(tail)-1;
+
+    //pad with spaces so that preamble+dict is modulo 16 bytes. preamble is 10 bytes. dict needs to end with \n
+    size_t padded = dict_size + 16 - (10 + dict_size) % 16;
+    if(header_size) {
+        if(10 + dict_size + 1 > header_size || header_size - 10 > 65535)
+            throw std::runtime_error("create_npy_header: header does not fit in the reserved space");
+        padded = header_size - 10;
+    }
+    if(padded > 65535) throw std::runtime_error("create_npy_header: header is longer than 65535 bytes");
+    size_t total = 10 + padded;
+    if(total > capacity) return total;
+
+    char* p = out;
+    *p++ = (char) 0x93;
+    memcpy(p,"NUMPY",5); p += 5;
+    *p++ = 0x01; //major version of numpy format
+    *p++ = 0x00; //minor version of numpy format
+    *p++ = (char) (padded & 0xff); //dict length, little endian
+    *p++ = (char) (padded >> 8);
+    memcpy(p,key_descr,sizeof(key_descr)-1); p += sizeof(key_descr)-1;
+    memcpy(p,descr,descr_len); p += descr_len;
+    memcpy(p,key_fortran,sizeof(key_fortran)-1); p += sizeof(key_fortran)-1;
+    memcpy(p,fortran_order ? "True" : "False",fortran_order ? 4 : 5); p += fortran_order ? 4 : 5;
+    memcpy(p,key_shape,sizeof(key_shape)-1); p += sizeof(key_shape)-1;
+    d = digits;
+    for(size_t i = 0;i < ndims;i++) {
+        if(i > 0) { *p++ = ','; *p++ = ' '; }
+        for(size_t n = ndigits[i];n > 0;n--) *p++ = d[n-1];
+        d += ndigits[i];
+    }
+    if(ndims == 1) *p++ = ',';
+    memcpy(p,tail,sizeof(tail)-1); p += sizeof(tail)-1;
+    memset(p,' ',out + total - p);
+    out[total-1] = '\n';
+    return total;
+}
+
 template<> std::vector<char>& cnpy::operator+=(std::vector<char>& lhs, const std::string rhs) {
     lhs.insert(lhs.end(),rhs.begin(),rhs.end());
     return lhs;
@@ -59,282 +134,3139 @@ template<> std::vector<char>& cnpy::operator+=(std::vector<char>& lhs, const cha
     return lhs;
 }
 
-void cnpy::parse_npy_header(unsigned char* buffer,size_t& word_size, std::vector<size_t>& shape, bool& fortran_order) {
-    //std::string magic_string(buffer,6);
-    uint8_t major_version = *reinterpret_cast<uint8_t*>(buffer+6);
-    uint8_t minor_version = *reinterpret_cast<uint8_t*>(buffer+7);
-    uint16_t header_len = *reinterpret_cast<uint16_t*>(buffer+8);
-    std::string header(reinterpret_cast<char*>(buffer+9),header_len);
+static thread_local cnpy::IoStats thread_io_stats;
+static cnpy::IoTrace io_trace;
+
+cnpy::IoStats& cnpy::io_stats() {
+    return thread_io_stats;
+}
+
+void cnpy::reset_io_stats() {
+    thread_io_stats = IoStats();
+}
+
+const char* cnpy::io_phase_name(IoPhase phase) {
+    static const char* names[IO_NUM_PHASES] = {"open", "seek", "read", "write", "header", "inflate", "deflate", "crc"};
+    return phase < IO_NUM_PHASES ? names[phase] : "unknown";
+}
+
+void cnpy::set_io_trace(const IoTrace& trace) {
+    io_trace = trace;
+}
+
+#ifdef CNPY_ENABLE_STATS
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+cnpy::IoPhaseTimer::IoPhaseTimer(IoPhase _phase, size_t _bytes) : phase(_phase), bytes(_bytes) {
+    if(io_trace) io_trace(phase,true,bytes);
+    start = now_ns();
+}
+
+cnpy::IoPhaseTimer::~IoPhaseTimer() {
+    thread_io_stats.nanoseconds[phase] += now_ns() - start;
+    thread_io_stats.calls[phase]++;
+    thread_io_stats.bytes[phase] += bytes;
+    if(io_trace) io_trace(phase,false,bytes);
+}
+#endif
+
+//the stdio and descriptor calls, each accounted to its phase
+static FILE* open_file(const std::string& fname, const char* mode) {
+    CNPY_IO_PHASE(cnpy::IO_OPEN,0);
+    return fopen(fname.c_str(),mode);
+}
+
+static int open_fd(const std::string& fname) {
+    CNPY_IO_PHASE(cnpy::IO_OPEN,0);
+    return open(fname.c_str(),O_RDONLY);
+}
+
+static bool seek_file(FILE* fp, size_t offset) {
+    CNPY_IO_PHASE(cnpy::IO_SEEK,0);
+    return fseek(fp,offset,SEEK_SET) == 0;
+}
+
+static bool read_file(FILE* fp, void* dst, size_t n) {
+    CNPY_IO_PHASE(cnpy::IO_READ,n);
+    return fread(dst,1,n,fp) == n;
+}
+
+static bool write_file(FILE* fp, const void* src, size_t n) {
+    CNPY_IO_PHASE(cnpy::IO_WRITE,n);
+    return fwrite(src,1,n,fp) == n;
+}
 
-    size_t loc1, loc2;
+static uint16_t read_u16(const unsigned char* p) {
+    return (uint16_t) (p[0] | (p[1] << 8));
+}
 
-    //fortran order
-    loc1 = header.find("fortran_order")+16;
-    fortran_order = (header.substr(loc1,4) == "True" ? true : false);
+static uint32_t read_u32(const unsigned char* p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
 
-    //shape
-    loc1 = header.find("(");
-    loc2 = header.find(")");
+static uint64_t read_u64(const unsigned char* p) {
+    return (uint64_t) read_u32(p) | ((uint64_t) read_u32(p+4) << 32);
+}
 
-    std::regex num_regex("[0-9][0-9]*");
-    std::smatch sm;
-    shape.clear();
+//size of the magic string, version, header length and header dict at the start of buffer
+static size_t npy_header_size(const unsigned char* buffer, size_t buffer_len) {
+    if(buffer_len < 10 || buffer[0] != 0x93 || memcmp(buffer+1,"NUMPY",5) != 0)
+        throw std::runtime_error("npy_header_size: not a npy file");
+    uint8_t major_version = buffer[6];
+    if(major_version < 1 || major_version > 3) throw std::runtime_error("npy: unsupported format version");
+    size_t header_size;
+    if(major_version == 1) {
+        header_size = 10 + (buffer[8] | (buffer[9] << 8));
+    }
+    else {
+        if(buffer_len < 12) throw std::runtime_error("npy_header_size: truncated header");
+        header_size = 12 + (buffer[8] | (buffer[9] << 8) | (buffer[10] << 16) | ((size_t) buffer[11] << 24));
+    }
+    if(header_size > buffer_len) throw std::runtime_error("npy_header_size: truncated header");
+    return header_size;
+}
 
-    std::string str_shape = header.substr(loc1+1,loc2-loc1-1);
-    while(std::regex_search(str_shape, sm, num_regex)) {
-        shape.push_back(std::stoi(sm[0].str()));
-        str_shape = sm.suffix().str();
+//bytes of data the shape describes, checked against the avail bytes that follow the header.
+//a corrupt shape must not overflow its way past the check, so the product is bounded as it is built
+static bool npy_data_fits(size_t word_size, const std::vector<size_t>& shape, size_t avail, size_t& nbytes) {
+    nbytes = word_size;
+    for(size_t i = 0;i < shape.size();i++) {
+        if(shape[i] && nbytes > avail / shape[i]) return false;
+        nbytes *= shape[i];
     }
+    return nbytes <= avail;
+}
 
-    //endian, word size, data type
-    //byte order code | stands for not applicable. 
-    //not sure when this applies except for byte array
-    loc1 = header.find("descr")+9;
-    bool littleEndian = (header[loc1] == '<' || header[loc1] == '|' ? true : false);
-    assert(littleEndian);
+namespace {
 
-    //char type = header[loc1+1];
-    //assert(type == map_type(T));
+//contents of the dict in an npy header
+struct NpyDict {
+    std::string descr; //for a structured dtype, the text of its list
+    size_t itemsize; //bytes per record of a structured dtype, 0 otherwise
+    bool fortran_order;
+    std::vector<size_t> shape;
+};
 
-    std::string str_ws = header.substr(loc1+2);
-    loc2 = str_ws.find("'");
-    word_size = atoi(str_ws.substr(0,loc2).c_str());
+//bytes per element of a simple descr such as '<f8', '|b1' or '<U10'
+size_t descr_word_size(const std::string& descr) {
+    if(descr.size() < 3) throw std::runtime_error("parse_npy_header: bad descr '"+descr+"'");
+    size_t n = atoi(descr.c_str()+2);
+    return descr[1] == 'U' ? 4*n : n;
 }
 
-void cnpy::parse_npy_header(FILE* fp, size_t& word_size, std::vector<size_t>& shape, bool& fortran_order) {  
-    char buffer[256];
-    size_t res = fread(buffer,sizeof(char),11,fp);       
-    if(res != 11)
-        throw std::runtime_error("parse_npy_header: failed fread");
-    std::string header = fgets(buffer,256,fp);
-    assert(header[header.size()-1] == '\n');
-
-    size_t loc1, loc2;
-
-    //fortran order
-    loc1 = header.find("fortran_order");
-    if (loc1 == std::string::npos)
-        throw std::runtime_error("parse_npy_header: failed to find header keyword: 'fortran_order'");
-    loc1 += 16;
-    fortran_order = (header.substr(loc1,4) == "True" ? true : false);
-
-    //shape
-    loc1 = header.find("(");
-    loc2 = header.find(")");
-    if (loc1 == std::string::npos || loc2 == std::string::npos)
-        throw std::runtime_error("parse_npy_header: failed to find header keyword: '(' or ')'");
-
-    std::regex num_regex("[0-9][0-9]*");
-    std::smatch sm;
-    shape.clear();
-
-    std::string str_shape = header.substr(loc1+1,loc2-loc1-1);
-    while(std::regex_search(str_shape, sm, num_regex)) {
-        shape.push_back(std::stoi(sm[0].str()));
-        str_shape = sm.suffix().str();
-    }
-
-    //endian, word size, data type
-    //byte order code | stands for not applicable. 
-    //not sure when this applies except for byte array
-    loc1 = header.find("descr");
-    if (loc1 == std::string::npos)
-        throw std::runtime_error("parse_npy_header: failed to find header keyword: 'descr'");
-    loc1 += 9;
-    bool littleEndian = (header[loc1] == '<' || header[loc1] == '|' ? true : false);
-    assert(littleEndian);
-
-    //char type = header[loc1+1];
-    //assert(type == map_type(T));
-
-    std::string str_ws = header.substr(loc1+2);
-    loc2 = str_ws.find("'");
-    word_size = atoi(str_ws.substr(0,loc2).c_str());
+//single pass parser for the python literal of an npy header, e.g.
+//{'descr': '<f8', 'fortran_order': False, 'shape': (3, 4), }
+class DictParser {
+  public:
+    DictParser(const char* _p, size_t len) : p(_p), end(_p + len) { }
+
+    void parse(NpyDict& dict) {
+        bool have_descr = false, have_order = false, have_shape = false;
+        dict.shape.clear();
+
+        expect('{');
+        while(!consume('}')) {
+            std::string key = string();
+            expect(':');
+            if(key == "descr") {
+                skip_space();
+                dict.itemsize = 0;
+                if(p < end && *p == '[') {
+                    const char* start = p;
+                    dict.itemsize = record();
+                    dict.descr.assign(start,p);
+                }
+                else {
+                    dict.descr = string();
+                }
+                have_descr = true;
+            }
+            else if(key == "fortran_order") {
+                dict.fortran_order = boolean();
+                have_order = true;
+            }
+            else if(key == "shape") {
+                expect('(');
+                while(!consume(')')) {
+                    dict.shape.push_back(integer());
+                    if(!consume(',')) {
+                        expect(')');
+                        break;
+                    }
+                }
+                have_shape = true;
+            }
+            else {
+                fail(("unknown key '"+key+"'").c_str());
+            }
+            if(!consume(',')) {
+                expect('}');
+                break;
+            }
+        }
+
+        if(!have_descr) fail("failed to find header keyword: 'descr'");
+        if(!have_order) fail("failed to find header keyword: 'fortran_order'");
+        if(!have_shape) fail("failed to find header keyword: 'shape'");
+    }
+
+  private:
+    void skip_space() {
+        while(p < end && (*p == ' ' || *p == '\t' || *p == '\n')) p++;
+    }
+
+    bool consume(char c) {
+        skip_space();
+        if(p < end && *p == c) {
+            p++;
+            return true;
+        }
+        return false;
+    }
+
+    void expect(char c) {
+        if(!consume(c)) fail((std::string("expected '")+c+"'").c_str());
+    }
+
+    //the list of a structured dtype, [('name', '<f8'), ('pos', '<f4', (3,)), ('sub', [...]), ...].
+    //returns the bytes per record
+    size_t record() {
+        expect('[');
+        size_t itemsize = 0;
+        while(!consume(']')) {
+            expect('(');
+            string();
+            expect(',');
+            skip_space();
+            size_t field_size;
+            if(p < end && *p == '[') {
+                field_size = record();
+            }
+            else {
+                std::string descr = string();
+                if(descr.size() < 3 || descr[0] == (CNPY_BYTE_ORDER == '<' ? '>' : '<'))
+                    fail(("unsupported field type '"+descr+"'").c_str());
+                field_size = descr_word_size(descr);
+            }
+            if(consume(',')) {
+                //subarray shape, a tuple or a single integer
+                if(consume('(')) {
+                    while(!consume(')')) {
+                        field_size *= integer();
+                        if(!consume(',')) {
+                            expect(')');
+                            break;
+                        }
+                    }
+                }
+                else {
+                    field_size *= integer();
+                }
+            }
+            expect(')');
+            itemsize += field_size;
+            if(!consume(',')) {
+                expect(']');
+                break;
+            }
+        }
+        return itemsize;
+    }
+
+    std::string string() {
+        skip_space();
+        if(p >= end || (*p != '\'' && *p != '"')) fail("expected a string");
+        char quote = *p++;
+        const char* start = p;
+        while(p < end && *p != quote) p++;
+        if(p >= end) fail("unterminated string");
+        return std::string(start, p++);
+    }
+
+    bool boolean() {
+        skip_space();
+        if(end - p >= 4 && memcmp(p,"True",4) == 0) { p += 4; return true; }
+        if(end - p >= 5 && memcmp(p,"False",5) == 0) { p += 5; return false; }
+        fail("expected True or False");
+        return false;
+    }
+
+    size_t integer() {
+        skip_space();
+        if(p >= end || *p < '0' || *p > '9') fail("expected an integer");
+        size_t value = 0;
+        while(p < end && *p >= '0' && *p <= '9') {
+            size_t digit = *p++ - '0';
+            if(value > ((size_t) -1 - digit) / 10) fail("dimension overflows size_t");
+            value = value * 10 + digit;
+        }
+        if(p < end && *p == 'L') p++; //written by python 2
+        return value;
+    }
+
+    void fail(const char* what) {
+        throw std::runtime_error(std::string("parse_npy_header: ")+what);
+    }
+
+    const char* p;
+    const char* end;
+};
+
+//parse the header at the start of buffer, which holds buffer_len bytes. returns the size of the header
+size_t parse_npy_buffer(const unsigned char* buffer, size_t buffer_len, NpyDict& dict) {
+    CNPY_IO_PHASE(cnpy::IO_HEADER,0);
+    size_t header_size = npy_header_size(buffer,buffer_len);
+    size_t preamble = (buffer[6] == 1) ? 10 : 12;
+    DictParser(reinterpret_cast<const char*>(buffer+preamble),header_size-preamble).parse(dict);
+    return header_size;
 }
 
-void cnpy::parse_zip_footer(FILE* fp, uint16_t& nrecs, size_t& global_header_size, size_t& global_header_offset)
+void unpack_npy_dict(NpyDict& dict, size_t& word_size, std::vector<size_t>& shape, bool& fortran_order) {
+    //byte order code | stands for not applicable, = for native. the parser checks the fields of records.
+    //headers can come from untrusted buffers, so a foreign byte order throws rather than asserts
+    bool foreign = !dict.itemsize && dict.descr[0] == (CNPY_BYTE_ORDER == '<' ? '>' : '<');
+    if(foreign) throw std::runtime_error("parse_npy_header: non-native byte order in descr "+dict.descr);
+
+    word_size = dict.itemsize ? dict.itemsize : descr_word_size(dict.descr);
+    shape.swap(dict.shape);
+    fortran_order = dict.fortran_order;
+}
+
+//the word size, shape and order of the header at the start of buffer. returns the size of the header
+size_t parse_npy_buffer(const unsigned char* buffer, size_t buffer_len, size_t& word_size, std::vector<size_t>& shape, bool& fortran_order) {
+    NpyDict dict;
+    size_t header_size = parse_npy_buffer(buffer,buffer_len,dict);
+    unpack_npy_dict(dict,word_size,shape,fortran_order);
+    return header_size;
+}
+
+cnpy::NpyInfo make_npy_info(const NpyDict& dict, size_t header_size) {
+    cnpy::NpyInfo info;
+    info.descr = dict.descr;
+    info.shape = dict.shape;
+    info.word_size = dict.itemsize ? dict.itemsize : descr_word_size(dict.descr);
+    info.fortran_order = dict.fortran_order;
+    info.header_size = header_size;
+    size_t nbytes;
+    if(!npy_data_fits(info.word_size,info.shape,SIZE_MAX - header_size,nbytes))
+        throw std::runtime_error("npy_info: the shape in the header overflows");
+    info.data_offset = header_size;
+    info.compr_method = 0;
+    info.compr_bytes = info.uncompr_bytes = header_size + nbytes;
+    return info;
+}
+
+}
+
+void cnpy::parse_npy_header(unsigned char* buffer,size_t& word_size, std::vector<size_t>& shape, bool& fortran_order) {
+    parse_npy_buffer(buffer,(size_t) -1,word_size,shape,fortran_order);
+}
+
+//locate the end of central directory record, following the ZIP64 locator when one of its
+//fields has overflowed. read_at(offset, n, dst) reads n bytes of the archive at offset.
+static void parse_zip_footer(size_t file_size, const std::function<void(size_t, size_t, unsigned char*)>& read_at,
+                             size_t& nrecs, size_t& global_header_size, size_t& global_header_offset)
 {
-    std::vector<char> footer(22);
-    fseek(fp,-22,SEEK_END);
-    size_t res = fread(&footer[0],sizeof(char),22,fp);
-    if(res != 22)
-        throw std::runtime_error("parse_zip_footer: failed fread");
-
-    uint16_t disk_no, disk_start, nrecs_on_disk, comment_len;
-    disk_no = *(uint16_t*) &footer[4];
-    disk_start = *(uint16_t*) &footer[6];
-    nrecs_on_disk = *(uint16_t*) &footer[8];
-    nrecs = *(uint16_t*) &footer[10];
-    global_header_size = *(uint32_t*) &footer[12];
-    global_header_offset = *(uint32_t*) &footer[16];
-    comment_len = *(uint16_t*) &footer[20];
+    if(file_size < 22) throw std::runtime_error("parse_zip_footer: end of central directory not found");
+
+    //the record is 22 bytes followed by a comment of up to 64 KiB
+    size_t tail_size = std::min<size_t>(file_size, 22 + 65535);
+    std::vector<unsigned char> tail(tail_size);
+    read_at(file_size - tail_size, tail_size, tail.data());
+
+    size_t pos = tail_size - 22;
+    while(read_u32(&tail[pos]) != 0x06054b50 || pos + 22 + read_u16(&tail[pos+20]) != tail_size) {
+        if(pos == 0) throw std::runtime_error("parse_zip_footer: end of central directory not found");
+        pos--;
+    }
+    const unsigned char* footer = &tail[pos];
+    size_t footer_offset = file_size - tail_size + pos;
+
+    uint16_t disk_no, disk_start, nrecs_on_disk;
+    disk_no = read_u16(footer+4);
+    disk_start = read_u16(footer+6);
+    nrecs_on_disk = read_u16(footer+8);
+    nrecs = read_u16(footer+10);
+    global_header_size = read_u32(footer+12);
+    global_header_offset = read_u32(footer+16);
 
     assert(disk_no == 0);
     assert(disk_start == 0);
     assert(nrecs_on_disk == nrecs);
-    assert(comment_len == 0);
+    (void) disk_no; (void) disk_start; (void) nrecs_on_disk;
+
+    if(nrecs != 0xFFFF && global_header_size != 0xFFFFFFFF && global_header_offset != 0xFFFFFFFF) return;
+
+    //ZIP64: the locator sits right before the footer and points at the ZIP64 end of central directory
+    unsigned char locator[20];
+    if(footer_offset < 20) throw std::runtime_error("parse_zip_footer: ZIP64 locator not found");
+    read_at(footer_offset - 20, 20, locator);
+    if(read_u32(locator) != 0x07064b50) throw std::runtime_error("parse_zip_footer: ZIP64 locator not found");
+
+    unsigned char footer64[56];
+    size_t footer64_offset = read_u64(locator+8);
+    if(footer64_offset > file_size || 56 > file_size - footer64_offset) throw std::runtime_error("parse_zip_footer: ZIP64 end of central directory not found");
+    read_at(footer64_offset, 56, footer64);
+    if(read_u32(footer64) != 0x06064b50) throw std::runtime_error("parse_zip_footer: ZIP64 end of central directory not found");
+
+    nrecs = read_u64(footer64+32);
+    global_header_size = read_u64(footer64+40);
+    global_header_offset = read_u64(footer64+48);
 }
 
-cnpy::NpyArray load_the_npy_file(FILE* fp) {
-    std::vector<size_t> shape;
-    size_t word_size;
-    bool fortran_order;
-    cnpy::parse_npy_header(fp,word_size,shape,fortran_order);
+void cnpy::parse_zip_footer(FILE* fp, size_t& nrecs, size_t& global_header_size, size_t& global_header_offset)
+{
+    fseek(fp,0,SEEK_END);
+    size_t file_size = ftell(fp);
+    ::parse_zip_footer(file_size,[fp](size_t offset, size_t n, unsigned char* dst) {
+        if(!seek_file(fp,offset) || !read_file(fp,dst,n)) throw std::runtime_error("parse_zip_footer: failed fread");
+    },nrecs,global_header_size,global_header_offset);
+}
 
-    cnpy::NpyArray arr(shape, word_size, fortran_order);
-    size_t nread = fread(arr.data<char>(),1,arr.num_bytes(),fp);
-    if(nread != arr.num_bytes())
-        throw std::runtime_error("load_the_npy_file: failed fread");
-    return arr;
+void cnpy::parse_zip_footer(FILE* fp, uint16_t& nrecs, size_t& global_header_size, size_t& global_header_offset)
+{
+    size_t nrecs64;
+    parse_zip_footer(fp,nrecs64,global_header_size,global_header_offset);
+    if(nrecs64 > 0xFFFF) throw std::runtime_error("parse_zip_footer: more than 65535 records, use the size_t overload");
+    nrecs = nrecs64;
 }
 
-cnpy::NpyArray load_the_npz_array(FILE* fp, uint32_t compr_bytes, uint32_t uncompr_bytes) {
+//parse nrecs central directory records in buffer into entries, in archive order
+static std::vector<cnpy::NpzEntry> parse_central_directory(const unsigned char* buffer, size_t size, size_t nrecs) {
+    std::vector<cnpy::NpzEntry> entries;
+    entries.reserve(nrecs);
+    size_t pos = 0;
+
+    for(size_t i = 0;i < nrecs;i++) {
+        if(pos + 46 > size || read_u32(buffer+pos) != 0x02014b50)
+            throw std::runtime_error("parse_central_directory: corrupt central directory");
+        const unsigned char* rec = buffer + pos;
+        uint16_t name_len = read_u16(rec+28);
+        uint16_t extra_field_len = read_u16(rec+30);
+        uint16_t comment_len = read_u16(rec+32);
+        if(pos + 46 + name_len > size)
+            throw std::runtime_error("parse_central_directory: corrupt central directory");
+
+        if(pos + 46 + name_len + extra_field_len > size)
+            throw std::runtime_error("parse_central_directory: corrupt central directory");
+
+        cnpy::NpzEntry e;
+        e.name.assign(reinterpret_cast<const char*>(rec+46),name_len);
+        //erase the lagging .npy
+        if(e.name.size() >= 4 && e.name.compare(e.name.size()-4,4,".npy") == 0) e.name.erase(e.name.size()-4);
+        e.compr_method = read_u16(rec+10);
+        e.crc = read_u32(rec+16);
+        e.compr_bytes = read_u32(rec+20);
+        e.uncompr_bytes = read_u32(rec+24);
+        e.local_header_offset = read_u32(rec+42);
+
+        //the ZIP64 extra field holds, in this order, whichever of these overflowed 32 bits
+        const unsigned char* extra = rec + 46 + name_len;
+        for(size_t x = 0;x + 4 <= extra_field_len;) {
+            uint16_t id = read_u16(extra+x);
+            uint16_t len = read_u16(extra+x+2);
+            if(x + 4 + len > extra_field_len)
+                throw std::runtime_error("parse_central_directory: corrupt extra field");
+            if(id == 0x0001) {
+                const unsigned char* field = extra + x + 4;
+                const unsigned char* field_end = field + len;
+                if(e.uncompr_bytes == 0xFFFFFFFF && field + 8 <= field_end) { e.uncompr_bytes = read_u64(field); field += 8; }
+                if(e.compr_bytes == 0xFFFFFFFF && field + 8 <= field_end) { e.compr_bytes = read_u64(field); field += 8; }
+                if(e.local_header_offset == 0xFFFFFFFF && field + 8 <= field_end) { e.local_header_offset = read_u64(field); field += 8; }
+            }
+            x += 4 + len;
+        }
+        entries.push_back(e);
+
+        pos += 46 + name_len + extra_field_len + comment_len;
+    }
+    return entries;
+}
 
-    std::vector<unsigned char> buffer_compr(compr_bytes);
-    std::vector<unsigned char> buffer_uncompr(uncompr_bytes);
-    size_t nread = fread(&buffer_compr[0],1,compr_bytes,fp);
-    if(nread != compr_bytes)
-        throw std::runtime_error("load_the_npy_file: failed fread");
+cnpy::NpyMappedFile::NpyMappedFile(const std::string& fname, bool copy_on_write) : addr(NULL), length(0) {
+    int fd = open_fd(fname);
+    if(fd < 0) throw std::runtime_error("NpyMappedFile: Unable to open file "+fname);
 
-    int err;
-    z_stream d_stream;
+    struct stat st;
+    if(fstat(fd,&st) != 0 || st.st_size == 0) {
+        close(fd);
+        throw std::runtime_error("NpyMappedFile: Unable to map empty or unreadable file "+fname);
+    }
+    length = st.st_size;
+
+    int prot = copy_on_write ? (PROT_READ | PROT_WRITE) : PROT_READ;
+    int flags = copy_on_write ? MAP_PRIVATE : MAP_SHARED;
+    void* p = mmap(NULL,length,prot,flags,fd,0);
+    close(fd); //the mapping holds its own reference to the file
+    if(p == MAP_FAILED) throw std::runtime_error("NpyMappedFile: mmap failed for "+fname);
+    addr = static_cast<char*>(p);
+}
 
-    d_stream.zalloc = Z_NULL;
-    d_stream.zfree = Z_NULL;
-    d_stream.opaque = Z_NULL;
-    d_stream.avail_in = 0;
-    d_stream.next_in = Z_NULL;
-    err = inflateInit2(&d_stream, -MAX_WBITS);
+cnpy::NpyMappedFile::~NpyMappedFile() {
+    if(addr) munmap(addr,length);
+}
 
-    d_stream.avail_in = compr_bytes;
-    d_stream.next_in = &buffer_compr[0];
-    d_stream.avail_out = uncompr_bytes;
-    d_stream.next_out = &buffer_uncompr[0];
+//crc32 takes a 32 bit length, so feed it large buffers in pieces
+static uint32_t crc32_bytes(uint32_t crc, const void* data, size_t nbytes) {
+    CNPY_IO_PHASE(cnpy::IO_CRC,nbytes);
+    const Bytef* p = static_cast<const Bytef*>(data);
+    while(nbytes > 0) {
+        uInt chunk = (uInt) std::min<size_t>(nbytes, 1u << 30);
+        crc = crc32(crc,p,chunk);
+        p += chunk;
+        nbytes -= chunk;
+    }
+    return crc;
+}
 
-    err = inflate(&d_stream, Z_FINISH);
-    err = inflateEnd(&d_stream);
+static unsigned resolve_nthreads(unsigned nthreads) {
+    return nthreads ? nthreads : std::max(1u, std::thread::hardware_concurrency());
+}
 
-    std::vector<size_t> shape;
-    size_t word_size;
-    bool fortran_order;
-    cnpy::parse_npy_header(&buffer_uncompr[0],word_size,shape,fortran_order);
+//add the stats of joined worker threads to the calling thread's
+static void add_worker_io_stats(const std::vector<cnpy::IoStats>& worker_stats) {
+#ifdef CNPY_ENABLE_STATS
+    cnpy::IoStats& total = cnpy::io_stats();
+    for(size_t t = 0;t < worker_stats.size();t++) {
+        for(int p = 0;p < cnpy::IO_NUM_PHASES;p++) {
+            total.calls[p] += worker_stats[t].calls[p];
+            total.bytes[p] += worker_stats[t].bytes[p];
+            total.nanoseconds[p] += worker_stats[t].nanoseconds[p];
+        }
+    }
+#else
+    (void) worker_stats;
+#endif
+}
 
-    cnpy::NpyArray array(shape, word_size, fortran_order);
+//run f(0) .. f(n-1) on up to nthreads threads (0 = one per core), including the calling one.
+//the first exception thrown by any f is rethrown here once every thread has finished.
+static void parallel_for(size_t n, unsigned nthreads, const std::function<void(size_t)>& f) {
+    nthreads = resolve_nthreads(nthreads);
+    size_t nworkers = std::min<size_t>(nthreads, n);
+    if(nworkers <= 1) {
+        for(size_t i = 0;i < n;i++) f(i);
+        return;
+    }
 
-    size_t offset = uncompr_bytes - array.num_bytes();
-    memcpy(array.data<unsigned char>(),&buffer_uncompr[0]+offset,array.num_bytes());
+    std::atomic<size_t> next(0);
+    std::exception_ptr error;
+    std::atomic<bool> failed(false);
+    auto work = [&]() {
+        for(size_t i = next++;i < n && !failed;i = next++) {
+            try { f(i); }
+            catch(...) {
+                if(!failed.exchange(true)) error = std::current_exception();
+            }
+        }
+    };
+
+    //the stats of each worker thread are added to the caller's once it has joined
+    std::vector<cnpy::IoStats> worker_stats(nworkers - 1);
+    std::vector<std::thread> threads;
+    for(size_t t = 1;t < nworkers;t++) {
+        cnpy::IoStats* stats = &worker_stats[t-1];
+        threads.push_back(std::thread([&work,stats]() {
+            work();
+            *stats = cnpy::io_stats();
+        }));
+    }
+    work();
+    for(size_t t = 0;t < threads.size();t++) threads[t].join();
+    add_worker_io_stats(worker_stats);
+    if(error) std::rethrow_exception(error);
+}
 
-    return array;
+//crc32 of nbytes split into 1 MiB pieces on nthreads threads, joined with crc32_combine
+static uint32_t crc32_parallel(uint32_t crc, const void* data, size_t nbytes, unsigned nthreads) {
+    const size_t piece = 1 << 20;
+    const char* p = static_cast<const char*>(data);
+    size_t npieces = (nbytes + piece - 1) / piece;
+    if(npieces <= 1 || resolve_nthreads(nthreads) == 1) return crc32_bytes(crc,data,nbytes);
+
+    std::vector<uint32_t> crcs(npieces);
+    parallel_for(npieces, nthreads, [&](size_t i) {
+        crcs[i] = crc32_bytes(0,p + i*piece,std::min(piece, nbytes - i*piece));
+    });
+    for(size_t i = 0;i < npieces;i++) crc = crc32_combine(crc,crcs[i],std::min(piece, nbytes - i*piece));
+    return crc;
 }
 
-cnpy::npz_t cnpy::npz_load(std::string fname) {
-    FILE* fp = fopen(fname.c_str(),"rb");
+namespace {
+
+//a sequential stream of bytes an npy file is read from
+class ByteSource {
+  public:
+    virtual ~ByteSource() { }
+    //read exactly n bytes into dst or throw
+    virtual void read(void* dst, size_t n) = 0;
+    //move past n bytes
+    virtual void skip(size_t n) {
+        char scratch[4096];
+        while(n > 0) {
+            size_t chunk = std::min(n, sizeof(scratch));
+            read(scratch,chunk);
+            n -= chunk;
+        }
+    }
+};
+
+class FileSource : public ByteSource {
+  public:
+    explicit FileSource(FILE* _fp) : fp(_fp) { }
+    void read(void* dst, size_t n) {
+        if(!read_file(fp,dst,n)) throw std::runtime_error("load_the_npy_file: failed fread");
+    }
+    void skip(size_t n) {
+        CNPY_IO_PHASE(cnpy::IO_SEEK,0);
+        fseek(fp,n,SEEK_CUR);
+    }
+
+  private:
+    FILE* fp;
+};
+
+//positioned reads on a shared descriptor, so several threads can read one file
+class PreadSource : public ByteSource {
+  public:
+    PreadSource(int _fd, size_t _offset) : fd(_fd), offset(_offset) { }
+    void read(void* dst, size_t n) {
+        char* out = static_cast<char*>(dst);
+        while(n > 0) {
+            ssize_t res;
+            {
+                CNPY_IO_PHASE(cnpy::IO_READ,n);
+                res = pread(fd,out,n,offset);
+            }
+            if(res < 0 && errno == EINTR) continue;
+            if(res <= 0) throw std::runtime_error("load_the_npy_file: failed pread");
+            out += res;
+            offset += res;
+            n -= res;
+        }
+    }
+    void skip(size_t n) {
+        offset += n;
+    }
+
+  private:
+    int fd;
+    size_t offset;
+};
+
+//reads from memory the caller has already checked to be long enough
+class MemorySource : public ByteSource {
+  public:
+    explicit MemorySource(const char* _p) : p(_p) { }
+    void read(void* dst, size_t n) {
+        memcpy(dst,p,n);
+        p += n;
+    }
+    void skip(size_t n) {
+        p += n;
+    }
+
+  private:
+    const char* p;
+};
+
+//the uncompressed bytes of a compressed npz member
+class MemberSource : public ByteSource {
+  public:
+    //move the input past the rest of the compressed member
+    virtual void skip_rest() = 0;
+};
+
+//inflates a raw deflate stream on demand, straight into the caller's buffer.
+//compressed input is pulled from another source in fixed size chunks, or used in place from memory.
+class InflateSource : public MemberSource {
+  public:
+    InflateSource(ByteSource* _in, size_t compr_bytes, size_t window_size = 1 << 18) : in(_in), compr_left(compr_bytes), window(window_size) {
+        init();
+    }
 
-    if(!fp) {
-        throw std::runtime_error("npz_load: Error! Unable to open file "+fname+"!");
+    InflateSource(const unsigned char* compr, size_t compr_bytes) : in(NULL), compr_left(compr_bytes) {
+        init();
+        next_memory = compr;
     }
 
-    cnpy::npz_t arrays;  
+    ~InflateSource() {
+        inflateEnd(&strm);
+    }
+
+    void skip_rest() {
+        if(in && compr_left) in->skip(compr_left);
+        compr_left = 0;
+    }
+
+    void read(void* dst, size_t n) {
+        unsigned char* out = static_cast<unsigned char*>(dst);
+        while(n > 0) {
+            if(strm.avail_in == 0) refill();
+            //avail_out is 32 bits wide
+            uInt chunk = (uInt) std::min<size_t>(n, 1u << 30);
+            strm.next_out = out;
+            strm.avail_out = chunk;
+            int err;
+            {
+                CNPY_IO_PHASE(cnpy::IO_INFLATE,0);
+                err = inflate(&strm,Z_NO_FLUSH);
+            }
+            size_t produced = chunk - strm.avail_out;
+            CNPY_IO_ADD_BYTES(cnpy::IO_INFLATE,produced);
+            out += produced;
+            n -= produced;
+            if(err == Z_STREAM_END && n > 0)
+                throw std::runtime_error("load_the_npz_array: compressed member ends early");
+            if(err != Z_OK && err != Z_STREAM_END && !(err == Z_BUF_ERROR && produced > 0))
+                throw std::runtime_error("load_the_npz_array: inflate failed");
+        }
+    }
+
+  private:
+    void init() {
+        strm.zalloc = Z_NULL;
+        strm.zfree = Z_NULL;
+        strm.opaque = Z_NULL;
+        strm.avail_in = 0;
+        strm.next_in = Z_NULL;
+        next_memory = NULL;
+        if(inflateInit2(&strm, -MAX_WBITS) != Z_OK)
+            throw std::runtime_error("load_the_npz_array: inflateInit2 failed");
+    }
 
-    while(1) {
-        std::vector<char> local_header(30);
-        size_t headerres = fread(&local_header[0],sizeof(char),30,fp);
-        if(headerres != 30)
-            throw std::runtime_error("npz_load: failed fread");
+    void refill() {
+        if(compr_left == 0) throw std::runtime_error("load_the_npz_array: compressed member ends early");
+        size_t chunk = std::min<size_t>(compr_left, in ? window.size() : (1u << 30));
+        if(in) {
+            in->read(window.data(),chunk);
+            strm.next_in = window.data();
+        }
+        else {
+            strm.next_in = const_cast<unsigned char*>(next_memory);
+            next_memory += chunk;
+        }
+        strm.avail_in = chunk;
+        compr_left -= chunk;
+    }
 
-        //if we've reached the global header, stop reading
-        if(local_header[2] != 0x03 || local_header[3] != 0x04) break;
+    z_stream strm;
+    ByteSource* in;
+    const unsigned char* next_memory;
+    size_t compr_left;
+    std::vector<unsigned char> window;
+};
+
+#ifdef CNPY_HAVE_ZSTD
+//the same for zstd members (zip method 93). the data may be one frame or several
+class ZstdSource : public MemberSource {
+  public:
+    ZstdSource(ByteSource* _in, size_t compr_bytes, size_t window_size = 1 << 18) : in(_in), compr_left(compr_bytes), window(window_size) {
+        init();
+    }
+
+    ZstdSource(const unsigned char* compr, size_t compr_bytes) : in(NULL), compr_left(compr_bytes) {
+        init();
+        next_memory = compr;
+    }
 
-        //read in the variable name
-        uint16_t name_len = *(uint16_t*) &local_header[26];
-        std::string varname(name_len,' ');
-        size_t vname_res = fread(&varname[0],sizeof(char),name_len,fp);
-        if(vname_res != name_len)
-            throw std::runtime_error("npz_load: failed fread");
+    ~ZstdSource() {
+        ZSTD_freeDStream(strm);
+    }
 
-        //erase the lagging .npy        
-        varname.erase(varname.end()-4,varname.end());
+    void skip_rest() {
+        if(in && compr_left) in->skip(compr_left);
+        compr_left = 0;
+    }
 
-        //read in the extra field
-        uint16_t extra_field_len = *(uint16_t*) &local_header[28];
-        if(extra_field_len > 0) {
-            std::vector<char> buff(extra_field_len);
-            size_t efield_res = fread(&buff[0],sizeof(char),extra_field_len,fp);
-            if(efield_res != extra_field_len)
-                throw std::runtime_error("npz_load: failed fread");
+    void read(void* dst, size_t n) {
+        ZSTD_outBuffer out = {dst, n, 0};
+        while(out.pos < out.size) {
+            size_t before = out.pos;
+            size_t res;
+            {
+                CNPY_IO_PHASE(cnpy::IO_INFLATE,0);
+                res = ZSTD_decompressStream(strm,&out,&input);
+            }
+            CNPY_IO_ADD_BYTES(cnpy::IO_INFLATE,out.pos - before);
+            if(ZSTD_isError(res))
+                throw std::runtime_error(std::string("load_the_npz_array: zstd decompression failed: ")+ZSTD_getErrorName(res));
+            //the decoder may still hold output when the input runs out, so only refill once it stalls
+            if(out.pos == before && input.pos == input.size) refill();
         }
+    }
 
-        uint16_t compr_method = *reinterpret_cast<uint16_t*>(&local_header[0]+8);
-        uint32_t compr_bytes = *reinterpret_cast<uint32_t*>(&local_header[0]+18);
-        uint32_t uncompr_bytes = *reinterpret_cast<uint32_t*>(&local_header[0]+22);
+  private:
+    void init() {
+        strm = ZSTD_createDStream();
+        if(!strm) throw std::runtime_error("load_the_npz_array: ZSTD_createDStream failed");
+        input.src = NULL;
+        input.size = input.pos = 0;
+        next_memory = NULL;
+    }
 
-        if(compr_method == 0) {arrays[varname] = load_the_npy_file(fp);}
-        else {arrays[varname] = load_the_npz_array(fp,compr_bytes,uncompr_bytes);}
+    void refill() {
+        if(compr_left == 0) throw std::runtime_error("load_the_npz_array: compressed member ends early");
+        size_t chunk = in ? std::min<size_t>(compr_left, window.size()) : compr_left;
+        if(in) {
+            in->read(window.data(),chunk);
+            input.src = window.data();
+        }
+        else {
+            input.src = next_memory;
+            next_memory += chunk;
+        }
+        input.size = chunk;
+        input.pos = 0;
+        compr_left -= chunk;
     }
 
-    fclose(fp);
-    return arrays;  
+    ZSTD_DStream* strm;
+    ZSTD_inBuffer input;
+    ByteSource* in;
+    const unsigned char* next_memory;
+    size_t compr_left;
+    std::vector<unsigned char> window;
+};
+#endif
+
+void unsupported_method(uint16_t method, const std::string& varname) {
+    throw std::runtime_error("npz_load: "+varname+" uses compression method "+std::to_string(method)+
+                             (method == 93 ? ", but cnpy was built without zstd" : ", which cnpy does not support"));
 }
 
-cnpy::NpyArray cnpy::npz_load(std::string fname, std::string varname) {
-    FILE* fp = fopen(fname.c_str(),"rb");
-
-    if(!fp) throw std::runtime_error("npz_load: Unable to open file "+fname);
-
-    while(1) {
-        std::vector<char> local_header(30);
-        size_t header_res = fread(&local_header[0],sizeof(char),30,fp);
-        if(header_res != 30)
-            throw std::runtime_error("npz_load: failed fread");
-
-        //if we've reached the global header, stop reading
-        if(local_header[2] != 0x03 || local_header[3] != 0x04) break;
-
-        //read in the variable name
-        uint16_t name_len = *(uint16_t*) &local_header[26];
-        std::string vname(name_len,' ');
-        size_t vname_res = fread(&vname[0],sizeof(char),name_len,fp);      
-        if(vname_res != name_len)
-            throw std::runtime_error("npz_load: failed fread");
-        vname.erase(vname.end()-4,vname.end()); //erase the lagging .npy
-
-        //read in the extra field
-        uint16_t extra_field_len = *(uint16_t*) &local_header[28];
-        fseek(fp,extra_field_len,SEEK_CUR); //skip past the extra field
-        
-        uint16_t compr_method = *reinterpret_cast<uint16_t*>(&local_header[0]+8);
-        uint32_t compr_bytes = *reinterpret_cast<uint32_t*>(&local_header[0]+18);
-        uint32_t uncompr_bytes = *reinterpret_cast<uint32_t*>(&local_header[0]+22);
-
-        if(vname == varname) {
-            NpyArray array  = (compr_method == 0) ? load_the_npy_file(fp) : load_the_npz_array(fp,compr_bytes,uncompr_bytes);
-            fclose(fp);
-            return array;
+//a decoder for the compr_bytes of compressed member varname, read from in
+std::unique_ptr<MemberSource> decompress(uint16_t method, ByteSource* in, size_t compr_bytes, const std::string& varname,
+                                         size_t window_size = 1 << 18) {
+    if(method == 8) return std::unique_ptr<MemberSource>(new InflateSource(in,compr_bytes,window_size));
+#ifdef CNPY_HAVE_ZSTD
+    if(method == 93) return std::unique_ptr<MemberSource>(new ZstdSource(in,compr_bytes,window_size));
+#endif
+    unsupported_method(method,varname);
+    return std::unique_ptr<MemberSource>();
+}
+
+//the same for a member already in memory
+std::unique_ptr<MemberSource> decompress(uint16_t method, const unsigned char* compr, size_t compr_bytes, const std::string& varname) {
+    if(method == 8) return std::unique_ptr<MemberSource>(new InflateSource(compr,compr_bytes));
+#ifdef CNPY_HAVE_ZSTD
+    if(method == 93) return std::unique_ptr<MemberSource>(new ZstdSource(compr,compr_bytes));
+#endif
+    unsupported_method(method,varname);
+    return std::unique_ptr<MemberSource>();
+}
+
+//read the npy header from src into a small buffer. returns the size of the header
+size_t read_the_npy_dict(ByteSource& src, NpyDict& dict) {
+    std::vector<unsigned char> header(12);
+    src.read(&header[0],10);
+    if(header[6] < 1 || header[6] > 3) throw std::runtime_error("npy: unsupported format version");
+    size_t preamble = (header[6] == 1) ? 10 : 12;
+    if(preamble == 12) src.read(&header[10],2);
+    size_t header_len = (preamble == 10) ? read_u16(&header[8]) : read_u32(&header[8]);
+    header.resize(preamble + header_len);
+    src.read(&header[preamble],header_len);
+
+    return parse_npy_buffer(&header[0],header.size(),dict);
+}
+
+size_t read_the_npy_header(ByteSource& src, size_t& word_size, std::vector<size_t>& shape, bool& fortran_order) {
+    NpyDict dict;
+    size_t header_size = read_the_npy_dict(src,dict);
+    unpack_npy_dict(dict,word_size,shape,fortran_order);
+    return header_size;
+}
+
+//loads fill every byte they allocate, so skip the zero-fill of NpyVectorStorage
+std::shared_ptr<cnpy::NpyStorage> default_allocate(size_t nbytes) {
+    return std::make_shared<cnpy::NpyAlignedStorage>(nbytes);
+}
+
+//the scalar types arrays can be converted between. complex values convert as pairs of F4 or F8
+enum NpyKind { B1, I1, I2, I4, I8, U1, U2, U4, U8, F4, F8 };
+
+struct NpyDtype {
+    NpyKind kind;
+    size_t components; //2 for complex types, 1 otherwise
+    bool swap; //stored in the opposite byte order to this machine
+};
+
+bool dtype_of(char type, size_t word_size, NpyDtype& dtype) {
+    dtype.components = 1;
+    dtype.swap = false;
+    if(type == 'c') {
+        type = 'f';
+        word_size /= 2;
+        dtype.components = 2;
+    }
+    switch(type) {
+        case 'b': if(word_size != 1) return false; dtype.kind = B1; return true;
+        case 'i': case 'u': case 'f': break;
+        default: return false;
+    }
+    bool is_float = (type == 'f');
+    bool is_signed = (type == 'i');
+    switch(word_size) {
+        case 1: if(is_float) return false; dtype.kind = is_signed ? I1 : U1; return true;
+        case 2: if(is_float) return false; dtype.kind = is_signed ? I2 : U2; return true;
+        case 4: dtype.kind = is_float ? F4 : (is_signed ? I4 : U4); return true;
+        case 8: dtype.kind = is_float ? F8 : (is_signed ? I8 : U8); return true;
+        default: return false;
+    }
+}
+
+size_t kind_size(NpyKind kind) {
+    static const size_t sizes[] = {1, 1, 2, 4, 8, 1, 2, 4, 8, 4, 8};
+    return sizes[kind];
+}
+
+//the loops below go through memcpy so that the compiler is free to vectorize them
+template<typename U> void swap_values(char* p, size_t n, U (*bswap)(U)) {
+    for(size_t i = 0;i < n;i++) {
+        U u;
+        memcpy(&u,p + i*sizeof(U),sizeof(U));
+        u = bswap(u);
+        memcpy(p + i*sizeof(U),&u,sizeof(U));
+    }
+}
+
+void swap_bytes(char* p, size_t size, size_t n) {
+    switch(size) {
+        case 2: swap_values<uint16_t>(p,n,[](uint16_t u) { return __builtin_bswap16(u); }); break;
+        case 4: swap_values<uint32_t>(p,n,[](uint32_t u) { return __builtin_bswap32(u); }); break;
+        case 8: swap_values<uint64_t>(p,n,[](uint64_t u) { return __builtin_bswap64(u); }); break;
+    }
+}
+
+typedef void (*ConvertFn)(const char* in, char* out, size_t n);
+
+template<typename S, typename D> void convert_values(const char* in, char* out, size_t n) {
+    for(size_t i = 0;i < n;i++) {
+        S s;
+        memcpy(&s,in + i*sizeof(S),sizeof(S));
+        D d = static_cast<D>(s);
+        memcpy(out + i*sizeof(D),&d,sizeof(D));
+    }
+}
+
+template<typename S> ConvertFn converter_from(NpyKind dst) {
+    switch(dst) {
+        case B1: return convert_values<S,bool>;
+        case I1: return convert_values<S,int8_t>;
+        case I2: return convert_values<S,int16_t>;
+        case I4: return convert_values<S,int32_t>;
+        case I8: return convert_values<S,int64_t>;
+        case U1: return convert_values<S,uint8_t>;
+        case U2: return convert_values<S,uint16_t>;
+        case U4: return convert_values<S,uint32_t>;
+        case U8: return convert_values<S,uint64_t>;
+        case F4: return convert_values<S,float>;
+        case F8: return convert_values<S,double>;
+    }
+    return NULL;
+}
+
+ConvertFn converter(NpyKind src, NpyKind dst) {
+    switch(src) {
+        case B1: return converter_from<uint8_t>(dst);
+        case I1: return converter_from<int8_t>(dst);
+        case I2: return converter_from<int16_t>(dst);
+        case I4: return converter_from<int32_t>(dst);
+        case I8: return converter_from<int64_t>(dst);
+        case U1: return converter_from<uint8_t>(dst);
+        case U2: return converter_from<uint16_t>(dst);
+        case U4: return converter_from<uint32_t>(dst);
+        case U8: return converter_from<uint64_t>(dst);
+        case F4: return converter_from<float>(dst);
+        case F8: return converter_from<double>(dst);
+    }
+    return NULL;
+}
+
+//read nvals values of dtype from into out as dtype to, one block at a time so that each block
+//is swapped and converted while it is still in cache
+void read_converted(ByteSource& src, const NpyDtype& from, const NpyDtype& to, char* out, size_t nvals) {
+    const size_t block = 1 << 16;
+    size_t in_size = kind_size(from.kind);
+    size_t out_size = kind_size(to.kind);
+    nvals *= from.components;
+
+    if(from.kind == to.kind) {
+        for(size_t done = 0;done < nvals;done += block) {
+            size_t n = std::min(block, nvals - done);
+            src.read(out + done*out_size,n*in_size);
+            if(from.swap) swap_bytes(out + done*out_size,in_size,n);
         }
-        else {
-            //skip past the data
-            uint32_t size = *(uint32_t*) &local_header[22];
-            fseek(fp,size,SEEK_CUR);
+        return;
+    }
+
+    ConvertFn convert = converter(from.kind,to.kind);
+    std::vector<char> scratch(block*in_size);
+    for(size_t done = 0;done < nvals;done += block) {
+        size_t n = std::min(block, nvals - done);
+        src.read(scratch.data(),n*in_size);
+        if(from.swap) swap_bytes(scratch.data(),in_size,n);
+        convert(scratch.data(),out + done*out_size,n);
+    }
+}
+
+//the dtypes to convert data stored as descr from and to, or throw if there is no conversion
+void conversion_dtypes(const std::string& descr, char type, size_t word_size, NpyDtype& from, NpyDtype& to) {
+    if(descr.size() < 3 || !dtype_of(descr[1],descr_word_size(descr),from) ||
+       !dtype_of(type,word_size,to) || from.components != to.components)
+        throw std::runtime_error("npy_load_as: cannot convert "+descr+" to "+type+std::to_string(word_size));
+    from.swap = kind_size(from.kind) > 1 && descr[0] == (CNPY_BYTE_ORDER == '<' ? '>' : '<');
+}
+
+//read the npy header, then the payload straight into storage from allocator.
+//with a type other than 0, the payload is converted to that type and word size on the way.
+//npy_bytes, when known, is the size of the whole npy the header must describe no more than
+cnpy::NpyArray load_the_npy(ByteSource& src, const cnpy::NpyAllocator& allocator = default_allocate,
+                            char type = 0, size_t word_size = 0, size_t npy_bytes = SIZE_MAX) {
+    NpyDict dict;
+    size_t header_size = read_the_npy_dict(src,dict);
+    if(header_size > npy_bytes) throw std::runtime_error("load_the_npy_file: the header runs past the end of the data");
+
+    std::vector<size_t> shape;
+    bool fortran_order;
+    NpyDtype from, to;
+    if(type == 0) {
+        unpack_npy_dict(dict,word_size,shape,fortran_order);
+    }
+    else {
+        shape = dict.shape;
+        fortran_order = dict.fortran_order;
+        conversion_dtypes(dict.descr,type,word_size,from,to);
+    }
+
+    //the header may come from an untrusted buffer, so neither the stored nor the loaded size may overflow
+    size_t nvals, nbytes, stored_bytes;
+    size_t stored_word_size = (type == 0) ? word_size : kind_size(from.kind) * from.components;
+    if(!npy_data_fits(1,shape,SIZE_MAX,nvals) || !npy_data_fits(word_size,shape,SIZE_MAX,nbytes) ||
+       !npy_data_fits(stored_word_size,shape,npy_bytes - header_size,stored_bytes))
+        throw std::runtime_error("load_the_npy_file: the data is shorter than its header says");
+    std::shared_ptr<cnpy::NpyStorage> storage = allocator(nbytes);
+    if(!storage || storage->size() < nbytes)
+        throw std::runtime_error("load_the_npy_file: allocator returned less than "+std::to_string(nbytes)+" bytes");
+
+    cnpy::NpyArray array(shape, word_size, fortran_order, storage);
+    if(type == 0) src.read(array.data<char>(),nbytes);
+    else read_converted(src,from,to,array.data<char>(),nvals);
+    return array;
+}
+
+//the values of array, stored as descr, converted to type and word size in a new array
+cnpy::NpyArray convert_array(const cnpy::NpyArray& array, const std::string& descr, char type, size_t word_size) {
+    NpyDtype from, to;
+    conversion_dtypes(descr,type,word_size,from,to);
+
+    cnpy::NpyArray result(array.shape, word_size, array.fortran_order, default_allocate(array.num_vals * word_size));
+    MemorySource src(array.data<char>());
+    read_converted(src,from,to,result.data<char>(),array.num_vals);
+    return result;
+}
+
+//passes reads through from another source and keeps the crc32 of every byte read.
+//large reads are checksummed one piece at a time, while the piece is still in cache.
+class CrcSource : public ByteSource {
+  public:
+    explicit CrcSource(ByteSource* _in) : in(_in), crc(0), nbytes(0) { }
+
+    void read(void* dst, size_t n) {
+        const size_t piece = 1 << 20;
+        char* out = static_cast<char*>(dst);
+        while(n > 0) {
+            size_t chunk = std::min(n, piece);
+            in->read(out,chunk);
+            crc = crc32_bytes(crc,out,chunk);
+            out += chunk;
+            n -= chunk;
+            nbytes += chunk;
         }
     }
 
-    fclose(fp);
+    uint32_t value() const { return crc; }
+    size_t bytes_read() const { return nbytes; }
+
+  private:
+    ByteSource* in;
+    uint32_t crc;
+    size_t nbytes;
+};
+
+//load_the_npy for the uncompressed bytes of member e. with verify_crc, the member is checked
+//against the crc32 and size in the central directory
+cnpy::NpyArray load_checked(ByteSource& src, const cnpy::NpzEntry& e, bool verify_crc, const std::string& fname,
+                            const cnpy::NpyAllocator& allocator = default_allocate, char type = 0, size_t word_size = 0) {
+    if(!verify_crc) return load_the_npy(src,allocator,type,word_size,e.uncompr_bytes);
+
+    CrcSource checked(&src);
+    cnpy::NpyArray array = load_the_npy(checked,allocator,type,word_size,e.uncompr_bytes);
+    if(checked.bytes_read() < e.uncompr_bytes) checked.skip(e.uncompr_bytes - checked.bytes_read());
+    if(checked.bytes_read() != e.uncompr_bytes || checked.value() != e.crc)
+        throw std::runtime_error("npz_load: CRC mismatch for "+e.name+" in "+fname);
+    return array;
+}
+
+//load member e, whose data starts at src
+cnpy::NpyArray load_the_member(ByteSource& src, const cnpy::NpzEntry& e, bool verify_crc, const std::string& fname,
+                               const cnpy::NpyAllocator& allocator = default_allocate, char type = 0, size_t word_size = 0) {
+    if(e.compr_method == 0) return load_checked(src,e,verify_crc,fname,allocator,type,word_size);
+
+    std::unique_ptr<MemberSource> decompressed = decompress(e.compr_method,&src,e.compr_bytes,e.name);
+    cnpy::NpyArray array = load_checked(*decompressed,e,verify_crc,fname,allocator,type,word_size);
+    decompressed->skip_rest();
+    return array;
+}
+
+//where the data of member e starts, from its local header
+size_t member_data_offset(int fd, const cnpy::NpzEntry& e, const std::string& fname) {
+    unsigned char local_header[30];
+    PreadSource(fd,e.local_header_offset).read(local_header,30);
+    if(read_u32(local_header) != 0x04034b50)
+        throw std::runtime_error("npz_load: bad local header for "+e.name+" in "+fname);
+    return e.local_header_offset + 30 + read_u16(local_header+26) + read_u16(local_header+28);
+}
+
+}
+
+void cnpy::parse_npy_header(FILE* fp, size_t& word_size, std::vector<size_t>& shape, bool& fortran_order) {  
+    FileSource src(fp);
+    read_the_npy_header(src,word_size,shape,fortran_order);
+}
+
+cnpy::NpyArray load_the_npy_file(FILE* fp, const cnpy::NpyAllocator& allocator = default_allocate) {
+    FileSource file(fp);
+    return load_the_npy(file,allocator);
+}
+
+cnpy::npz_t cnpy::npz_load(std::string fname) {
+    NpzReader reader(fname);
+    cnpy::npz_t arrays;
 
-    //if we get here, we haven't found the variable in the file
-    throw std::runtime_error("npz_load: Variable name "+varname+" not found in "+fname);
+    //entries are in archive order, so this reads the file front to back
+    const std::vector<NpzEntry>& entries = reader.entries();
+    for(size_t i = 0;i < entries.size();i++) arrays[entries[i].name] = reader.get(entries[i].name);
+
+    return arrays;
+}
+
+cnpy::NpyArray cnpy::npz_load(std::string fname, std::string varname) {
+    NpzReader reader(fname);
+    return reader.get(varname);
+}
+
+cnpy::NpyArray cnpy::npz_load(std::string fname, std::string varname, const NpyAllocator& allocator) {
+    NpzReader reader(fname);
+    return reader.get(varname,allocator);
+}
+
+cnpy::NpyArray cnpy::npz_load_into(std::string fname, std::string varname, void* dst, size_t capacity) {
+    NpzReader reader(fname);
+    return reader.get(varname,buffer_allocator(dst,capacity));
 }
 
 cnpy::NpyArray cnpy::npy_load(std::string fname) {
+    return npy_load(fname,default_allocate);
+}
+
+cnpy::NpyArray cnpy::npy_load(std::string fname, const NpyAllocator& allocator) {
 
-    FILE* fp = fopen(fname.c_str(), "rb");
+    FILE* fp = open_file(fname,"rb");
 
     if(!fp) throw std::runtime_error("npy_load: Unable to open file "+fname);
 
-    NpyArray arr = load_the_npy_file(fp);
+    try {
+        NpyArray arr = load_the_npy_file(fp,allocator);
+        fclose(fp);
+        return arr;
+    }
+    catch(...) {
+        fclose(fp);
+        throw;
+    }
+}
+
+cnpy::NpyArray cnpy::npy_load_as(std::string fname, char type, size_t word_size) {
+    FILE* fp = open_file(fname,"rb");
+    if(!fp) throw std::runtime_error("npy_load_as: Unable to open file "+fname);
 
-    fclose(fp);
-    return arr;
+    try {
+        FileSource src(fp);
+        NpyArray arr = load_the_npy(src,default_allocate,type,word_size);
+        fclose(fp);
+        return arr;
+    }
+    catch(...) {
+        fclose(fp);
+        throw;
+    }
+}
+
+cnpy::NpyArray cnpy::npy_load_into(std::string fname, void* dst, size_t capacity) {
+    return npy_load(fname,buffer_allocator(dst,capacity));
+}
+
+cnpy::NpyAlignedStorage::NpyAlignedStorage(size_t _nbytes, size_t alignment) : addr(NULL), nbytes(_nbytes) {
+    void* p = NULL;
+    if(posix_memalign(&p,alignment,std::max<size_t>(nbytes,1)) != 0)
+        throw std::runtime_error("NpyAlignedStorage: unable to allocate "+std::to_string(nbytes)+" bytes");
+    addr = static_cast<char*>(p);
+}
+
+cnpy::NpyAlignedStorage::~NpyAlignedStorage() {
+    free(addr);
+}
+
+cnpy::NpyAllocator cnpy::aligned_allocator(size_t alignment) {
+    return [alignment](size_t nbytes) -> std::shared_ptr<NpyStorage> {
+        return std::make_shared<NpyAlignedStorage>(nbytes,alignment);
+    };
+}
+
+cnpy::NpyAllocator cnpy::buffer_allocator(void* dst, size_t capacity) {
+    return [dst,capacity](size_t nbytes) -> std::shared_ptr<NpyStorage> {
+        if(nbytes > capacity)
+            throw std::runtime_error("buffer_allocator: array needs "+std::to_string(nbytes)+" bytes, buffer holds "+std::to_string(capacity));
+        return std::make_shared<NpyBufferStorage>(static_cast<char*>(dst),nbytes);
+    };
 }
 
+cnpy::NpyArray cnpy::npy_mmap(std::string fname, bool copy_on_write) {
+    std::shared_ptr<NpyStorage> file = std::make_shared<NpyMappedFile>(fname, copy_on_write);
+    unsigned char* buffer = reinterpret_cast<unsigned char*>(file->data());
+    std::vector<size_t> shape;
+    size_t word_size;
+    bool fortran_order;
+    size_t header_size = parse_npy_buffer(buffer,file->size(),word_size,shape,fortran_order);
+
+    size_t nbytes;
+    if(!npy_data_fits(word_size,shape,file->size() - header_size,nbytes))
+        throw std::runtime_error("npy_mmap: "+fname+" is shorter than its header says");
 
+    std::shared_ptr<NpyStorage> view = std::make_shared<NpyStorageView>(file, header_size, nbytes);
+    return NpyArray(shape, word_size, fortran_order, view);
+}
 
+namespace {
+
+//copies a Fortran-order array into C order. the index space is halved along its longest axis
+//until a block holds at most block_vals elements, so the reads and writes of each block stay in
+//cache whatever the shape and the cache sizes are
+class Transposer {
+  public:
+    Transposer(const char* _in, char* _out, const std::vector<size_t>& shape, size_t _word_size) :
+        in(_in), out(_out), ndims(shape.size()), word_size(_word_size),
+        in_stride(shape.size()), out_stride(shape.size()), index(shape.size()) {
+        for(size_t d = 0;d < ndims;d++) in_stride[d] = d ? in_stride[d-1] * shape[d-1] : word_size;
+        for(size_t d = ndims;d-- > 0;) out_stride[d] = (d + 1 < ndims) ? out_stride[d+1] * shape[d+1] : word_size;
+    }
+
+    void run(const std::vector<size_t>& shape) {
+        std::vector<size_t> lo(ndims,0), hi = shape;
+        split(lo,hi);
+    }
+
+  private:
+    static const size_t block_vals = 1024;
+
+    void split(std::vector<size_t>& lo, std::vector<size_t>& hi) {
+        size_t volume = 1, longest = 0;
+        for(size_t d = 0;d < ndims;d++) {
+            volume *= hi[d] - lo[d];
+            if(hi[d] - lo[d] > hi[longest] - lo[longest]) longest = d;
+        }
+        if(volume <= block_vals) {
+            copy_block(lo,hi);
+            return;
+        }
+
+        size_t start = lo[longest], end = hi[longest];
+        size_t mid = start + (end - start) / 2;
+        hi[longest] = mid;
+        split(lo,hi);
+        hi[longest] = end;
+        lo[longest] = mid;
+        split(lo,hi);
+        lo[longest] = start;
+    }
+
+    //one run per index of the leading axes, along the last axis, which is contiguous in the output
+    void copy_block(const std::vector<size_t>& lo, const std::vector<size_t>& hi) {
+        size_t last = ndims - 1;
+        size_t run = hi[last] - lo[last];
+        if(run == 0) return;
+        for(size_t d = 0;d < last;d++) {
+            if(hi[d] == lo[d]) return;
+            index[d] = lo[d];
+        }
+
+        while(true) {
+            size_t in_offset = lo[last] * in_stride[last];
+            size_t out_offset = lo[last] * out_stride[last];
+            for(size_t d = 0;d < last;d++) {
+                in_offset += index[d] * in_stride[d];
+                out_offset += index[d] * out_stride[d];
+            }
+            copy_run(in + in_offset,out + out_offset,run);
+
+            size_t d = last;
+            while(d > 0 && ++index[d-1] == hi[d-1]) {
+                index[d-1] = lo[d-1];
+                d--;
+            }
+            if(d == 0) return;
+        }
+    }
+
+    template<size_t W> static void gather(const char* src, size_t stride, char* dst, size_t n) {
+        for(size_t i = 0;i < n;i++) memcpy(dst + i*W,src + i*stride,W);
+    }
+
+    void copy_run(const char* src, char* dst, size_t n) {
+        size_t stride = in_stride[ndims-1];
+        switch(word_size) {
+            case 1: gather<1>(src,stride,dst,n); break;
+            case 2: gather<2>(src,stride,dst,n); break;
+            case 4: gather<4>(src,stride,dst,n); break;
+            case 8: gather<8>(src,stride,dst,n); break;
+            case 16: gather<16>(src,stride,dst,n); break;
+            default:
+                for(size_t i = 0;i < n;i++) memcpy(dst + i*word_size,src + i*stride,word_size);
+        }
+    }
+
+    const char* in;
+    char* out;
+    size_t ndims;
+    size_t word_size;
+    std::vector<size_t> in_stride, out_stride; //bytes between neighbours along each axis
+    std::vector<size_t> index;
+};
+
+}
+
+cnpy::NpyArray cnpy::to_c_order(const NpyArray& array) {
+    if(!array.fortran_order) return array;
+
+    std::shared_ptr<NpyStorage> storage = std::make_shared<NpyAlignedStorage>(array.num_bytes());
+    NpyArray result(array.shape, array.word_size, false, storage);
+    if(array.shape.size() <= 1) {
+        memcpy(result.data<char>(),array.data<char>(),array.num_bytes());
+    }
+    else if(array.num_vals > 0) {
+        Transposer transposer(array.data<char>(),result.data<char>(),array.shape,array.word_size);
+        transposer.run(array.shape);
+    }
+    return result;
+}
+
+cnpy::NpyArray cnpy::npy_load_c_order(std::string fname) {
+    NpyArray mapped = npy_mmap(fname);
+    if(mapped.fortran_order) return to_c_order(mapped);
+
+    //an owned copy, as npy_load returns, from the header already parsed out of the mapping
+    std::shared_ptr<NpyStorage> storage = std::make_shared<NpyAlignedStorage>(mapped.num_bytes());
+    memcpy(storage->data(),mapped.data<char>(),mapped.num_bytes());
+    return NpyArray(mapped.shape,mapped.word_size,false,storage);
+}
+
+const size_t cnpy::NpyDirectFile::alignment;
+
+cnpy::NpyDirectFile::NpyDirectFile(const std::string& _fname, size_t _header_size, size_t chunk_bytes) :
+    fname(_fname), fd(-1), direct(false), header_size(_header_size), fill(0), offset(_header_size), pending_offset(0), pending_bytes(0) {
+    if(header_size % alignment != 0)
+        throw std::runtime_error("NpyDirectFile: header size of "+fname+" is not a multiple of "+std::to_string(alignment));
+    chunk_bytes = std::max(aligned(chunk_bytes), alignment);
+    buffer = std::make_shared<NpyAlignedStorage>(chunk_bytes,alignment);
+
+    CNPY_IO_PHASE(IO_OPEN,0);
+#ifdef O_DIRECT
+    fd = open(fname.c_str(),O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT,0644);
+    direct = fd >= 0;
+    if(fd < 0 && errno != EINVAL) throw std::runtime_error("NpyDirectFile: Unable to open file "+fname);
+#endif
+    if(fd < 0) fd = open(fname.c_str(),O_WRONLY | O_CREAT | O_TRUNC,0644);
+    if(fd < 0) throw std::runtime_error("NpyDirectFile: Unable to open file "+fname);
+}
+
+cnpy::NpyDirectFile::~NpyDirectFile() {
+    if(fd >= 0) ::close(fd);
+}
+
+void cnpy::NpyDirectFile::write_at(const char* data, size_t n, size_t at) {
+    CNPY_IO_PHASE(IO_WRITE,n);
+    while(n > 0) {
+        ssize_t res = pwrite(fd,data,std::min<size_t>(n, 1u << 30),at);
+        if(res < 0 && errno == EINTR) continue;
+        if(res <= 0) throw std::runtime_error("NpyDirectFile: failed write to "+fname);
+        data += res;
+        at += res;
+        n -= res;
+    }
+}
+
+//start writeback of the chunk just written, then wait for the one before it and drop it from the
+//page cache, so at most two chunks of the file are cached at a time
+void cnpy::NpyDirectFile::drop_behind(size_t at, size_t n) {
+#ifdef SYNC_FILE_RANGE_WRITE
+    sync_file_range(fd,at,n,SYNC_FILE_RANGE_WRITE);
+    if(pending_bytes) {
+        sync_file_range(fd,pending_offset,pending_bytes,SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#ifdef POSIX_FADV_DONTNEED
+        posix_fadvise(fd,pending_offset,pending_bytes,POSIX_FADV_DONTNEED);
+#endif
+    }
+#else
+    if(pending_bytes) {
+        fdatasync(fd);
+#ifdef POSIX_FADV_DONTNEED
+        posix_fadvise(fd,pending_offset,pending_bytes,POSIX_FADV_DONTNEED);
+#endif
+    }
+#endif
+    pending_offset = at;
+    pending_bytes = n;
+}
+
+void cnpy::NpyDirectFile::write(const void* data, size_t n) {
+    if(fd < 0) throw std::runtime_error("NpyDirectFile: "+fname+" is closed");
+    const char* p = static_cast<const char*>(data);
+    size_t chunk_bytes = buffer->size();
+    while(n > 0) {
+        //aligned whole chunks of the caller's memory can go straight to the file
+        if(fill == 0 && n >= chunk_bytes && (!direct || reinterpret_cast<uintptr_t>(p) % alignment == 0)) {
+            write_at(p,chunk_bytes,offset);
+            if(!direct) drop_behind(offset,chunk_bytes);
+            offset += chunk_bytes;
+            p += chunk_bytes;
+            n -= chunk_bytes;
+            continue;
+        }
+
+        size_t copy = std::min(n, chunk_bytes - fill);
+        memcpy(buffer->data() + fill,p,copy);
+        fill += copy;
+        p += copy;
+        n -= copy;
+        if(fill == chunk_bytes) {
+            write_at(buffer->data(),chunk_bytes,offset);
+            if(!direct) drop_behind(offset,chunk_bytes);
+            offset += chunk_bytes;
+            fill = 0;
+        }
+    }
+}
+
+void cnpy::NpyDirectFile::write_header(const std::vector<char>& header) {
+    if(fd < 0) throw std::runtime_error("NpyDirectFile: "+fname+" is closed");
+    if(header.size() != header_size)
+        throw std::runtime_error("NpyDirectFile: header of "+fname+" must be "+std::to_string(header_size)+" bytes");
+    NpyAlignedStorage block(header_size,alignment);
+    memcpy(block.data(),header.data(),header_size);
+    write_at(block.data(),header_size,0);
+}
+
+void cnpy::NpyDirectFile::close() {
+    if(fd < 0) return;
+    try {
+        size_t end = offset + fill;
+        if(fill) {
+            //O_DIRECT writes whole blocks, so pad the last one and cut the file back afterwards
+            size_t padded = direct ? aligned(fill) : fill;
+            memset(buffer->data() + fill,0,padded - fill);
+            write_at(buffer->data(),padded,offset);
+        }
+        if(direct && ftruncate(fd,end) != 0) throw std::runtime_error("NpyDirectFile: failed to truncate "+fname);
+        if(!direct) {
+            fdatasync(fd);
+#ifdef POSIX_FADV_DONTNEED
+            posix_fadvise(fd,0,0,POSIX_FADV_DONTNEED);
+#endif
+        }
+    }
+    catch(...) {
+        ::close(fd);
+        fd = -1;
+        throw;
+    }
+    int err = ::close(fd);
+    fd = -1;
+    if(err != 0) throw std::runtime_error("NpyDirectFile: failed to close "+fname);
+}
+
+cnpy::NpyArray cnpy::npy_load_direct(std::string fname) {
+    const size_t alignment = NpyDirectFile::alignment;
+    int fd = -1;
+    bool direct = false;
+    {
+        CNPY_IO_PHASE(IO_OPEN,0);
+#ifdef O_DIRECT
+        fd = open(fname.c_str(),O_RDONLY | O_DIRECT);
+        direct = fd >= 0;
+#endif
+        if(fd < 0) fd = open(fname.c_str(),O_RDONLY);
+    }
+    if(fd < 0) throw std::runtime_error("npy_load_direct: Unable to open file "+fname);
+
+    try {
+        struct stat st;
+        if(fstat(fd,&st) != 0) throw std::runtime_error("npy_load_direct: Unable to stat "+fname);
+        size_t file_size = st.st_size;
+
+        //read the whole file into one aligned buffer and return a view past the header,
+        //so neither the header nor the data has to be copied
+        std::shared_ptr<NpyStorage> storage = std::make_shared<NpyAlignedStorage>(NpyDirectFile::aligned(std::max<size_t>(file_size,1)),alignment);
+        size_t done = 0;
+        while(done < file_size) {
+            size_t n = std::min<size_t>(NpyDirectFile::aligned(file_size - done), 1u << 30);
+            ssize_t res;
+            {
+                CNPY_IO_PHASE(IO_READ,n);
+                res = pread(fd,storage->data() + done,n,done);
+            }
+            if(res < 0 && errno == EINTR) continue;
+            if(res < 0 && errno == EINVAL && direct) {
+                //the file system accepted O_DIRECT at open but not for reads
+                int buffered = open(fname.c_str(),O_RDONLY);
+                if(buffered < 0) throw std::runtime_error("npy_load_direct: Unable to open file "+fname);
+                close(fd);
+                fd = buffered;
+                direct = false;
+                continue;
+            }
+            if(res <= 0) throw std::runtime_error("npy_load_direct: failed read of "+fname);
+            done += res;
+        }
+#ifdef POSIX_FADV_DONTNEED
+        if(!direct) posix_fadvise(fd,0,0,POSIX_FADV_DONTNEED);
+#endif
+        close(fd);
+        fd = -1;
+
+        const unsigned char* buffer = reinterpret_cast<const unsigned char*>(storage->data());
+        std::vector<size_t> shape;
+        size_t word_size;
+        bool fortran_order;
+        size_t header_size = parse_npy_buffer(buffer,file_size,word_size,shape,fortran_order);
+        size_t nbytes;
+        if(!npy_data_fits(word_size,shape,file_size - header_size,nbytes))
+            throw std::runtime_error("npy_load_direct: "+fname+" is shorter than its header says");
+
+        std::shared_ptr<NpyStorage> view = std::make_shared<NpyStorageView>(storage,header_size,nbytes);
+        return NpyArray(shape,word_size,fortran_order,view);
+    }
+    catch(...) {
+        if(fd >= 0) close(fd);
+        throw;
+    }
+}
+
+cnpy::NpzMap::NpzMap(const std::string& _fname, bool copy_on_write, bool _verify_crc) : fname(_fname), verify_crc(_verify_crc) {
+    file = std::make_shared<NpyMappedFile>(fname, copy_on_write);
+    index_members();
+}
+
+cnpy::NpzMap::NpzMap(const std::shared_ptr<NpyStorage>& buffer, bool _verify_crc) : fname("memory buffer"), verify_crc(_verify_crc), file(buffer) {
+    index_members();
+}
+
+void cnpy::NpzMap::index_members() {
+    const unsigned char* base = reinterpret_cast<const unsigned char*>(file->data());
+    size_t size = file->size();
+
+    size_t nrecs, global_header_size, global_header_offset;
+    ::parse_zip_footer(size,[base](size_t offset, size_t n, unsigned char* dst) {
+        memcpy(dst,base+offset,n);
+    },nrecs,global_header_size,global_header_offset);
+    if(global_header_offset > size || global_header_size > size - global_header_offset)
+        throw std::runtime_error("NpzMap: truncated central directory in "+fname);
+
+    std::vector<NpzEntry> entries = parse_central_directory(base+global_header_offset,global_header_size,nrecs);
+    for(size_t i = 0;i < entries.size();i++) {
+        const NpzEntry& e = entries[i];
+        if(e.local_header_offset > size || 30 > size - e.local_header_offset)
+            throw std::runtime_error("NpzMap: truncated local header in "+fname);
+        const unsigned char* local_header = base + e.local_header_offset;
+        uint16_t name_len = read_u16(local_header+26);
+        uint16_t extra_field_len = read_u16(local_header+28);
+
+        Member m;
+        m.crc = e.crc;
+        m.compr_method = e.compr_method;
+        m.compr_bytes = e.compr_bytes;
+        m.uncompr_bytes = e.uncompr_bytes;
+        m.data_offset = e.local_header_offset + 30 + name_len + extra_field_len;
+        if(m.data_offset > size || m.compr_bytes > size - m.data_offset)
+            throw std::runtime_error("NpzMap: truncated member "+e.name+" in "+fname);
+        members[e.name] = m;
+    }
+}
+
+bool cnpy::NpzMap::contains(const std::string& varname) const {
+    return members.count(varname) != 0;
+}
+
+std::string cnpy::npy_record_descr(const std::vector<NpyField>& fields, size_t itemsize) {
+    std::vector<NpyField> sorted(fields);
+    std::stable_sort(sorted.begin(),sorted.end(),[](const NpyField& a, const NpyField& b) { return a.offset < b.offset; });
+
+    std::string descr = "[";
+    size_t pos = 0;
+    for(size_t i = 0;i < sorted.size();i++) {
+        const NpyField& f = sorted[i];
+        if(f.offset < pos) throw std::runtime_error("npy_record_descr: field "+f.name+" overlaps the field before it");
+        if(f.offset > pos) descr += "('', '|V"+std::to_string(f.offset - pos)+"'), ";
+        descr += "('"+f.name+"', "+f.descr;
+        if(!f.shape.empty()) {
+            descr += ", (";
+            for(size_t d = 0;d < f.shape.size();d++) descr += std::to_string(f.shape[d]) + (d + 1 < f.shape.size() ? ", " : "");
+            descr += f.shape.size() == 1 ? ",)" : ")";
+        }
+        descr += "), ";
+        pos = f.offset + f.size;
+    }
+    if(pos > itemsize) throw std::runtime_error("npy_record_descr: fields run past the end of the record");
+    if(pos < itemsize) descr += "('', '|V"+std::to_string(itemsize - pos)+"'), ";
+    if(descr.size() > 1) descr.resize(descr.size() - 2);
+    return descr + "]";
+}
+
+bool cnpy::NpzMap::is_compressed(const std::string& varname) const {
+    std::map<std::string, Member>::const_iterator it = members.find(varname);
+    return it != members.end() && it->second.compr_method != 0;
+}
+
+std::vector<std::string> cnpy::NpzMap::names() const {
+    std::vector<std::string> result;
+    for(std::map<std::string, Member>::const_iterator it = members.begin();it != members.end();++it)
+        result.push_back(it->first);
+    return result;
+}
+
+cnpy::NpyArray cnpy::NpzMap::get(const std::string& varname) const {
+    std::map<std::string, Member>::const_iterator it = members.find(varname);
+    if(it == members.end())
+        throw std::runtime_error("NpzMap: Variable name "+varname+" not found in "+fname);
+    const Member& m = it->second;
+    const unsigned char* buffer = reinterpret_cast<const unsigned char*>(file->data()) + m.data_offset;
+
+    if(m.compr_method != 0) {
+        std::unique_ptr<MemberSource> src = decompress(m.compr_method,buffer,m.compr_bytes,varname);
+        NpzEntry e;
+        e.name = varname;
+        e.crc = m.crc;
+        e.uncompr_bytes = m.uncompr_bytes;
+        return load_checked(*src,e,verify_crc,fname);
+    }
+
+    //the stored member is already in memory, so check it on every core
+    if(verify_crc && (m.compr_bytes != m.uncompr_bytes || crc32_parallel(0,buffer,m.compr_bytes,0) != m.crc))
+        throw std::runtime_error("NpzMap: CRC mismatch for "+varname+" in "+fname);
+
+    std::vector<size_t> shape;
+    size_t word_size;
+    bool fortran_order;
+    size_t header_size = parse_npy_buffer(buffer,m.compr_bytes,word_size,shape,fortran_order);
+
+    size_t nbytes;
+    if(!npy_data_fits(word_size,shape,m.compr_bytes - header_size,nbytes))
+        throw std::runtime_error("NpzMap: member "+varname+" is shorter than its header says");
+
+    std::shared_ptr<NpyStorage> view = std::make_shared<NpyStorageView>(file, m.data_offset + header_size, nbytes);
+    return NpyArray(shape, word_size, fortran_order, view);
+}
+
+cnpy::NpyArray cnpy::npy_deserialize(const std::shared_ptr<NpyStorage>& buffer) {
+    size_t size = buffer->size();
+    std::vector<size_t> shape;
+    size_t word_size;
+    bool fortran_order;
+    size_t header_size = parse_npy_buffer(reinterpret_cast<const unsigned char*>(buffer->data()),size,word_size,shape,fortran_order);
+
+    size_t nbytes;
+    if(!npy_data_fits(word_size,shape,size - header_size,nbytes)) throw std::runtime_error("npy_deserialize: buffer is shorter than its header says");
+
+    std::shared_ptr<NpyStorage> view = std::make_shared<NpyStorageView>(buffer,header_size,nbytes);
+    return NpyArray(shape,word_size,fortran_order,view);
+}
+
+cnpy::NpyArray cnpy::npy_deserialize(const void* buffer, size_t size) {
+    return npy_deserialize(std::make_shared<NpyBufferStorage>(static_cast<char*>(const_cast<void*>(buffer)),size));
+}
+
+cnpy::NpzMap cnpy::npz_open_memory(const void* buffer, size_t size, bool verify_crc) {
+    return NpzMap(std::make_shared<NpyBufferStorage>(static_cast<char*>(const_cast<void*>(buffer)),size),verify_crc);
+}
+
+cnpy::NpzLazy::NpzLazy(const std::string& fname, size_t budget_bytes, bool verify_crc) :
+    archive(fname,false,verify_crc), budget(budget_bytes), cached(0) { }
+
+cnpy::NpyArray cnpy::NpzLazy::get(const std::string& varname) {
+    if(!archive.is_compressed(varname)) return archive.get(varname);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::unordered_map<std::string, Lru::iterator>::iterator it = cache.find(varname);
+        if(it != cache.end()) {
+            lru.splice(lru.begin(),lru,it->second);
+            return it->second->second;
+        }
+    }
+
+    //decompress without the lock, so other members can be served meanwhile
+    NpyArray array = archive.get(varname);
+    size_t nbytes = array.num_bytes();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unordered_map<std::string, Lru::iterator>::iterator it = cache.find(varname);
+    if(it != cache.end()) return it->second->second;
+    if(budget && nbytes > budget) return array;
+    while(budget && cached + nbytes > budget) {
+        cached -= lru.back().second.num_bytes();
+        cache.erase(lru.back().first);
+        lru.pop_back();
+    }
+    lru.push_front(std::make_pair(varname,array));
+    cache[varname] = lru.begin();
+    cached += nbytes;
+    return array;
+}
+
+size_t cnpy::NpzLazy::cached_bytes() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return cached;
+}
+
+void cnpy::NpzLazy::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    lru.clear();
+    cache.clear();
+    cached = 0;
+}
+
+cnpy::NpzReader::NpzReader(const std::string& _fname, bool _verify_crc) : fname(_fname), verify_crc(_verify_crc) {
+    fp = open_file(fname,"rb");
+    if(!fp) throw std::runtime_error("NpzReader: Unable to open file "+fname);
+
+    try {
+        size_t nrecs, global_header_size, global_header_offset;
+        parse_zip_footer(fp,nrecs,global_header_size,global_header_offset);
+
+        std::vector<unsigned char> global_header(global_header_size);
+        if(!seek_file(fp,global_header_offset) || !read_file(fp,global_header.data(),global_header_size))
+            throw std::runtime_error("NpzReader: failed fread of central directory in "+fname);
+
+        members = parse_central_directory(global_header.data(),global_header_size,nrecs);
+    }
+    catch(...) {
+        fclose(fp);
+        throw;
+    }
+
+    data_offsets.assign(members.size(),0);
+    for(size_t i = 0;i < members.size();i++) index[members[i].name] = i;
+}
+
+cnpy::NpzReader::~NpzReader() {
+    fclose(fp);
+}
+
+bool cnpy::NpzReader::contains(const std::string& varname) const {
+    return index.count(varname) != 0;
+}
+
+std::vector<std::string> cnpy::NpzReader::names() const {
+    std::vector<std::string> result;
+    for(size_t i = 0;i < members.size();i++) result.push_back(members[i].name);
+    return result;
+}
+
+const cnpy::NpzEntry& cnpy::NpzReader::entry(const std::string& varname) const {
+    std::unordered_map<std::string, size_t>::const_iterator it = index.find(varname);
+    if(it == index.end())
+        throw std::runtime_error("NpzReader: Variable name "+varname+" not found in "+fname);
+    return members[it->second];
+}
+
+cnpy::NpyArray cnpy::NpzReader::get(const std::string& varname) {
+    return get(varname,default_allocate);
+}
+
+size_t cnpy::NpzReader::seek_to_data(const std::string& varname) {
+    const NpzEntry& e = entry(varname);
+    size_t i = index[varname];
+
+    //the local header may carry a different extra field than the central directory,
+    //so read it once to find where the data starts
+    if(data_offsets[i] == 0) {
+        unsigned char local_header[30];
+        if(!seek_file(fp,e.local_header_offset) || !read_file(fp,local_header,30) || read_u32(local_header) != 0x04034b50)
+            throw std::runtime_error("NpzReader: bad local header for "+varname+" in "+fname);
+        data_offsets[i] = e.local_header_offset + 30 + read_u16(local_header+26) + read_u16(local_header+28);
+    }
+    seek_file(fp,data_offsets[i]);
+    return data_offsets[i];
+}
+
+cnpy::NpyArray cnpy::NpzReader::get(const std::string& varname, const NpyAllocator& allocator) {
+    if(!contains(varname) && is_chunked(varname)) return load_chunked(varname,0,0,true,0,allocator);
+    const NpzEntry& e = entry(varname);
+    seek_to_data(varname);
+
+    FileSource file(fp);
+    return load_the_member(file,e,verify_crc,fname,allocator);
+}
+
+cnpy::NpyArray cnpy::NpzReader::get_as(const std::string& varname, char type, size_t word_size) {
+    //chunked arrays are reassembled in the dtype they are stored in, then converted
+    if(!contains(varname) && is_chunked(varname))
+        return convert_array(load_chunked(varname,0,0,true,0,default_allocate),info(npz_chunk_name(varname,0)).descr,type,word_size);
+    const NpzEntry& e = entry(varname);
+    seek_to_data(varname);
+
+    FileSource file(fp);
+    return load_the_member(file,e,verify_crc,fname,default_allocate,type,word_size);
+}
+
+cnpy::NpyInfo cnpy::NpzReader::info(const std::string& varname) {
+    const NpzEntry& e = entry(varname);
+    size_t data_offset = seek_to_data(varname);
+
+    NpyDict dict;
+    size_t header_size;
+    FileSource file(fp);
+    if(e.compr_method == 0) {
+        header_size = read_the_npy_dict(file,dict);
+    }
+    else {
+        //the header is in the first few hundred bytes of the stream
+        std::unique_ptr<MemberSource> src = decompress(e.compr_method,&file,e.compr_bytes,varname,4096);
+        header_size = read_the_npy_dict(*src,dict);
+    }
+
+    NpyInfo result = make_npy_info(dict,header_size);
+    result.data_offset = (e.compr_method == 0) ? data_offset + header_size : data_offset;
+    result.compr_method = e.compr_method;
+    result.compr_bytes = e.compr_bytes;
+    result.uncompr_bytes = e.uncompr_bytes;
+    return result;
+}
+
+bool cnpy::NpzReader::is_chunked(const std::string& varname) const {
+    return contains(varname + ".chunks") && contains(npz_chunk_name(varname,0));
+}
+
+cnpy::NpyArray cnpy::NpzReader::get_rows(const std::string& varname, size_t start, size_t count, unsigned nthreads) {
+    return load_chunked(varname,start,count,false,nthreads,default_allocate);
+}
+
+cnpy::NpyArray cnpy::NpzReader::load_chunked(const std::string& varname, size_t start, size_t count, bool all_rows, unsigned nthreads,
+                                             const NpyAllocator& allocator) {
+    if(!is_chunked(varname)) throw std::runtime_error("NpzReader: "+varname+" in "+fname+" is not a chunked array");
+    NpyArray manifest = get(varname + ".chunks");
+    if(manifest.word_size != 8 || manifest.shape.size() != 2 || manifest.shape[1] != 3)
+        throw std::runtime_error("NpzReader: bad chunk manifest for "+varname+" in "+fname);
+    const uint64_t* chunks = manifest.data<uint64_t>();
+    size_t nchunks = manifest.shape[0];
+
+    //each chunk must start where the one before it ends, or rows would be missed or written twice
+    size_t total_rows = 0;
+    for(size_t i = 0;i < nchunks;i++) {
+        if(chunks[3*i] != total_rows || chunks[3*i+1] > SIZE_MAX - total_rows)
+            throw std::runtime_error("NpzReader: bad chunk manifest for "+varname+" in "+fname);
+        total_rows += chunks[3*i+1];
+    }
+    if(all_rows) count = total_rows;
+    if(start > total_rows || count > total_rows - start)
+        throw std::runtime_error("NpzReader: rows are out of bounds of "+varname+" in "+fname);
+
+    //the dtype and the shape of a row come from the first chunk
+    NpyInfo first = info(npz_chunk_name(varname,0));
+    if(first.fortran_order || first.shape.empty())
+        throw std::runtime_error("NpzReader: chunks of "+varname+" in "+fname+" are not C-order arrays");
+    std::vector<size_t> shape = first.shape;
+    shape[0] = count;
+    size_t row_bytes = first.word_size;
+    for(size_t d = 1;d < shape.size();d++) row_bytes *= shape[d];
+
+    std::shared_ptr<NpyStorage> storage = allocator(count * row_bytes);
+    if(!storage || storage->size() < count * row_bytes)
+        throw std::runtime_error("NpzReader: allocator returned less than "+std::to_string(count * row_bytes)+" bytes");
+    NpyArray result(shape,first.word_size,false,storage);
+
+    std::vector<size_t> touched;
+    for(size_t i = 0;i < nchunks;i++) {
+        if(chunks[3*i] < start + count && chunks[3*i] + chunks[3*i+1] > start) touched.push_back(i);
+    }
+
+    int fd = open_fd(fname);
+    if(fd < 0) throw std::runtime_error("NpzReader: Unable to open file "+fname);
+    try {
+        parallel_for(touched.size(),nthreads,[&](size_t k) {
+            size_t i = touched[k];
+            size_t chunk_start = chunks[3*i], chunk_rows = chunks[3*i+1];
+            const NpzEntry& e = entry(npz_chunk_name(varname,i));
+            if(e.crc != (uint32_t) chunks[3*i+2])
+                throw std::runtime_error("NpzReader: "+e.name+" in "+fname+" does not match the chunk manifest");
+
+            size_t lo = std::max(start,chunk_start);
+            size_t hi = std::min(start + count,chunk_start + chunk_rows);
+            char* dst = result.data<char>() + (lo - start) * row_bytes;
+            PreadSource src(fd,member_data_offset(fd,e,fname));
+
+            //whole chunks inflate straight into place, the two at the ends of a row range through a buffer
+            NpyArray chunk;
+            if(lo == chunk_start && hi == chunk_start + chunk_rows)
+                chunk = load_the_member(src,e,verify_crc,fname,buffer_allocator(dst,chunk_rows * row_bytes));
+            else
+                chunk = load_the_member(src,e,verify_crc,fname);
+            if(chunk.fortran_order || chunk.shape.size() != shape.size() || chunk.shape[0] != chunk_rows ||
+               chunk.word_size != first.word_size || !std::equal(shape.begin()+1,shape.end(),chunk.shape.begin()+1))
+                throw std::runtime_error("NpzReader: "+e.name+" in "+fname+" does not match the chunk manifest");
+            if(chunk.data<char>() != dst) memcpy(dst,chunk.data<char>() + (lo - chunk_start) * row_bytes,(hi - lo) * row_bytes);
+        });
+    }
+    catch(...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    return result;
+}
+
+std::string cnpy::npz_chunk_name(const std::string& varname, size_t i) {
+    std::string index = std::to_string(i);
+    if(index.size() < 5) index.insert(0,5 - index.size(),'0');
+    return varname + ".chunk" + index;
+}
+
+cnpy::NpyInfo cnpy::npy_info(std::string fname) {
+    FILE* fp = open_file(fname,"rb");
+    if(!fp) throw std::runtime_error("npy_info: Unable to open file "+fname);
+
+    try {
+        NpyDict dict;
+        FileSource src(fp);
+        size_t header_size = read_the_npy_dict(src,dict);
+        fclose(fp);
+        return make_npy_info(dict,header_size);
+    }
+    catch(...) {
+        fclose(fp);
+        throw;
+    }
+}
+
+std::map<std::string, cnpy::NpyInfo> cnpy::npz_list(std::string fname) {
+    NpzReader reader(fname);
+    std::map<std::string, NpyInfo> result;
+    const std::vector<NpzEntry>& entries = reader.entries();
+    for(size_t i = 0;i < entries.size();i++) result[entries[i].name] = reader.info(entries[i].name);
+    return result;
+}
+
+//raw deflate of npy_header followed by data into out, and the crc32 of the uncompressed bytes.
+//the npy header and each block_size slice of data are compressed independently (primed with the
+//preceding 32 KiB as dictionary) and end in a sync flush, so their concatenation is one stream.
+static void deflate_npy(const std::vector<char>& npy_header, const char* data, size_t data_bytes,
+                        const cnpy::NpzCompression& compression, std::vector<char>& out, uint32_t& crc) {
+    const size_t window = 32768;
+    //blocks must fit zlib's 32 bit avail_in/avail_out
+    size_t block_size = std::min<size_t>(std::max<size_t>(compression.block_size, window), 1u << 30);
+
+    struct Block {
+        const char* in;
+        size_t in_bytes;
+        const char* dict;
+        size_t dict_bytes;
+        std::vector<char> out;
+        uint32_t crc;
+    };
+    std::vector<Block> blocks(1);
+    blocks[0].in = npy_header.data();
+    blocks[0].in_bytes = npy_header.size();
+    blocks[0].dict = NULL;
+    blocks[0].dict_bytes = 0;
+    for(size_t offset = 0;offset < data_bytes;offset += block_size) {
+        Block b;
+        b.in = data + offset;
+        b.in_bytes = std::min(block_size, data_bytes - offset);
+        const Block& prev = blocks.back();
+        b.dict_bytes = std::min(window, prev.in_bytes);
+        b.dict = prev.in + prev.in_bytes - b.dict_bytes;
+        blocks.push_back(b);
+    }
+
+    parallel_for(blocks.size(), compression.nthreads, [&](size_t i) {
+        Block& b = blocks[i];
+        bool last = (i + 1 == blocks.size());
+        b.crc = crc32_bytes(0,b.in,b.in_bytes);
+
+        z_stream strm;
+        strm.zalloc = Z_NULL;
+        strm.zfree = Z_NULL;
+        strm.opaque = Z_NULL;
+        if(deflateInit2(&strm,compression.level,Z_DEFLATED,-MAX_WBITS,8,Z_DEFAULT_STRATEGY) != Z_OK)
+            throw std::runtime_error("npz_save: deflateInit2 failed");
+        if(b.dict_bytes) deflateSetDictionary(&strm,(const Bytef*) b.dict,b.dict_bytes);
+
+        //deflateBound covers Z_FINISH; a sync flush adds at most an empty stored block
+        b.out.resize(deflateBound(&strm,b.in_bytes) + 16);
+        strm.next_in = (Bytef*) b.in;
+        strm.avail_in = b.in_bytes;
+        strm.next_out = (Bytef*) b.out.data();
+        strm.avail_out = b.out.size();
+
+        int err;
+        {
+            CNPY_IO_PHASE(cnpy::IO_DEFLATE,b.in_bytes);
+            err = deflate(&strm,last ? Z_FINISH : Z_SYNC_FLUSH);
+        }
+        size_t produced = strm.total_out;
+        deflateEnd(&strm);
+
+        if(err != (last ? Z_STREAM_END : Z_OK) || strm.avail_in != 0)
+            throw std::runtime_error("npz_save: deflate failed");
+        b.out.resize(produced);
+    });
+
+    size_t total = 0;
+    for(size_t i = 0;i < blocks.size();i++) total += blocks[i].out.size();
+    out.clear();
+    out.reserve(total);
+
+    crc = 0;
+    for(size_t i = 0;i < blocks.size();i++) {
+        out.insert(out.end(),blocks[i].out.begin(),blocks[i].out.end());
+        crc = crc32_combine(crc,blocks[i].crc,blocks[i].in_bytes);
+        std::vector<char>().swap(blocks[i].out);
+    }
+}
+
+#ifdef CNPY_HAVE_ZSTD
+//zstd frame of npy_header followed by data into out, and the crc32 of the uncompressed bytes.
+//large payloads are compressed by nthreads zstd workers, which still produce a single frame
+static void zstd_npy(const std::vector<char>& npy_header, const char* data, size_t data_bytes,
+                     const cnpy::NpzCompression& compression, std::vector<char>& out, uint32_t& crc) {
+    unsigned nthreads = resolve_nthreads(compression.nthreads);
+    crc = crc32_parallel(crc32_bytes(0,npy_header.data(),npy_header.size()),data,data_bytes,nthreads);
+
+    ZSTD_CCtx* cctx = ZSTD_createCCtx();
+    if(!cctx) throw std::runtime_error("npz_save: ZSTD_createCCtx failed");
+    int level = (compression.level == Z_DEFAULT_COMPRESSION) ? ZSTD_CLEVEL_DEFAULT : compression.level;
+    ZSTD_CCtx_setParameter(cctx,ZSTD_c_compressionLevel,level);
+    //a libzstd built without threads rejects this and compresses on the calling thread
+    if(nthreads > 1 && data_bytes > compression.block_size) ZSTD_CCtx_setParameter(cctx,ZSTD_c_nbWorkers,nthreads);
+    ZSTD_CCtx_setPledgedSrcSize(cctx,npy_header.size() + data_bytes);
+
+    out.resize(ZSTD_compressBound(npy_header.size() + data_bytes));
+    ZSTD_outBuffer dst = {out.data(), out.size(), 0};
+    ZSTD_inBuffer header = {npy_header.data(), npy_header.size(), 0};
+    ZSTD_inBuffer payload = {data, data_bytes, 0};
+    size_t res = 0;
+    {
+        CNPY_IO_PHASE(cnpy::IO_DEFLATE,npy_header.size() + data_bytes);
+        while(header.pos < header.size && !ZSTD_isError(res)) res = ZSTD_compressStream2(cctx,&dst,&header,ZSTD_e_continue);
+        do {
+            if(!ZSTD_isError(res)) res = ZSTD_compressStream2(cctx,&dst,&payload,ZSTD_e_end);
+        } while(res != 0 && !ZSTD_isError(res) && dst.pos < dst.size);
+    }
+    ZSTD_freeCCtx(cctx);
+
+    if(ZSTD_isError(res)) throw std::runtime_error(std::string("npz_save: zstd compression failed: ")+ZSTD_getErrorName(res));
+    if(res != 0) throw std::runtime_error("npz_save: zstd output larger than ZSTD_compressBound");
+    out.resize(dst.pos);
+}
+#endif
+
+bool cnpy::npz_compression_supported(uint16_t method) {
+#ifdef CNPY_HAVE_ZSTD
+    if(method == 93) return true;
+#endif
+    return method == 0 || method == 8;
+}
+
+template<size_t N> static void gather_values(char* out, const char* in, size_t n, ptrdiff_t stride) {
+    for(size_t i = 0;i < n;i++) memcpy(out + i*N,in + i*stride,N);
+}
+
+//copy n elements of word_size bytes, stride bytes apart, to out
+static void gather(char* out, const char* in, size_t n, ptrdiff_t stride, size_t word_size) {
+    switch(word_size) {
+        case 1: gather_values<1>(out,in,n,stride); return;
+        case 2: gather_values<2>(out,in,n,stride); return;
+        case 4: gather_values<4>(out,in,n,stride); return;
+        case 8: gather_values<8>(out,in,n,stride); return;
+        case 16: gather_values<16>(out,in,n,stride); return;
+    }
+    for(size_t i = 0;i < n;i++) memcpy(out + i*word_size,in + i*stride,word_size);
+}
+
+bool cnpy::write_strided(FILE* fp, const char* base, const std::vector<size_t>& shape, const std::vector<ptrdiff_t>& byte_strides,
+                         size_t word_size, size_t block_bytes) {
+    //merge neighbouring axes that step through memory as one longer axis, and drop axes of length 1
+    std::vector<size_t> dims;
+    std::vector<ptrdiff_t> strides;
+    for(size_t i = 0;i < shape.size();i++) {
+        if(shape[i] == 0) return true;
+        if(shape[i] == 1) continue;
+        if(!dims.empty() && strides.back() == byte_strides[i] * (ptrdiff_t) shape[i]) {
+            dims.back() *= shape[i];
+            strides.back() = byte_strides[i];
+        }
+        else {
+            dims.push_back(shape[i]);
+            strides.push_back(byte_strides[i]);
+        }
+    }
+    if(dims.empty()) {
+        dims.push_back(1);
+        strides.push_back((ptrdiff_t) word_size);
+    }
+
+    //the innermost axis is copied a run at a time, the outer ones are counted off by index
+    size_t n = dims.back();
+    ptrdiff_t step = strides.back();
+    bool contiguous = (step == (ptrdiff_t) word_size);
+    size_t nruns = std::accumulate(dims.begin(),dims.end()-1,(size_t) 1,std::multiplies<size_t>());
+    std::vector<size_t> index(dims.size() - 1, 0);
+
+    block_bytes = std::max(block_bytes, word_size);
+    size_t block_vals = block_bytes / word_size;
+    std::vector<char> block;
+    size_t fill = 0;
+
+    const char* run = base;
+    for(size_t r = 0;r < nruns;r++) {
+        if(contiguous && n >= block_vals) {
+            if((fill && !write_file(fp,block.data(),fill)) || !write_file(fp,run,n * word_size)) return false;
+            fill = 0;
+        }
+        else {
+            if(block.empty()) block.resize(block_vals * word_size);
+            for(size_t done = 0;done < n;) {
+                size_t count = std::min(n - done, block_vals - fill / word_size);
+                if(contiguous) memcpy(&block[fill],run + done * word_size,count * word_size);
+                else gather(&block[fill],run + (ptrdiff_t) done * step,count,step,word_size);
+                fill += count * word_size;
+                done += count;
+                if(fill == block.size()) {
+                    if(!write_file(fp,block.data(),fill)) return false;
+                    fill = 0;
+                }
+            }
+        }
+
+        for(size_t d = index.size();d-- > 0;) {
+            run += strides[d];
+            if(++index[d] < dims[d]) break;
+            run -= strides[d] * (ptrdiff_t) dims[d];
+            index[d] = 0;
+        }
+    }
+    return fill == 0 || write_file(fp,block.data(),fill);
+}
+
+//fwrite data to fp, updating crc as it goes. each batch is checksummed on nthreads threads
+//right before it is written, so the data is pulled through the cache once.
+//the workers are started once per call: they checksum 1 MiB pieces at most two batches ahead of
+//the write, and the calling thread writes each batch as soon as all of its pieces are done
+static bool write_with_crc(FILE* fp, const char* data, size_t nbytes, unsigned nthreads, uint32_t& crc) {
+    const size_t piece = 1 << 20;
+    nthreads = resolve_nthreads(nthreads);
+    size_t batch = (size_t) nthreads << 22;
+    if(nthreads == 1 || nbytes <= piece) {
+        for(size_t offset = 0;offset < nbytes;offset += batch) {
+            size_t chunk = std::min(batch, nbytes - offset);
+            crc = crc32_bytes(crc,data + offset,chunk);
+            if(!write_file(fp,data + offset,chunk)) return false;
+        }
+        return true;
+    }
+
+    size_t npieces = (nbytes + piece - 1) / piece;
+    size_t batch_pieces = batch / piece;
+    std::vector<uint32_t> crcs(npieces);
+    std::vector<char> done(npieces,0);
+    std::mutex mutex;
+    std::condition_variable piece_done, room;
+    size_t next = 0, written = 0; //pieces handed out, and pieces written
+    bool stop = false;
+
+    auto work = [&]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for(;;) {
+            room.wait(lock,[&]() { return stop || next == npieces || next < written + 2*batch_pieces; });
+            if(stop || next == npieces) return;
+            size_t i = next++;
+            lock.unlock();
+            uint32_t c = crc32_bytes(0,data + i*piece,std::min(piece, nbytes - i*piece));
+            lock.lock();
+            crcs[i] = c;
+            done[i] = 1;
+            piece_done.notify_one();
+        }
+    };
+
+    std::vector<cnpy::IoStats> worker_stats(nthreads);
+    std::vector<std::thread> threads;
+    for(size_t t = 0;t < nthreads;t++) {
+        cnpy::IoStats* stats = &worker_stats[t];
+        threads.push_back(std::thread([&work,stats]() {
+            work();
+            *stats = cnpy::io_stats();
+        }));
+    }
+
+    bool ok = true;
+    for(size_t first = 0;first < npieces && ok;first += batch_pieces) {
+        size_t last = std::min(first + batch_pieces, npieces);
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            for(size_t i = first;i < last;i++) {
+                piece_done.wait(lock,[&]() { return done[i] != 0; });
+                crc = crc32_combine(crc,crcs[i],std::min(piece, nbytes - i*piece));
+            }
+        }
+        ok = write_file(fp,data + first*piece,std::min(last*piece, nbytes) - first*piece);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            written = last;
+            stop = !ok;
+        }
+        room.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    room.notify_all();
+    for(size_t t = 0;t < threads.size();t++) threads[t].join();
+    add_worker_io_stats(worker_stats);
+    return ok;
+}
+
+void cnpy::npz_write_member(const std::string& zipname, std::string fname, const std::vector<char>& npy_header,
+                            const void* data, size_t data_bytes, const std::string& mode, const NpzCompression& compression)
+{
+    NpzWriter writer(zipname,mode);
+    writer.add_member(fname,npy_header,data,data_bytes,compression);
+    writer.close();
+}
+
+cnpy::NpzWriter::NpzWriter(const std::string& _zipname, const std::string& mode) :
+    zipname(_zipname), fp(NULL), memory(NULL), memory_base(0), nrecs(0), global_header_offset(0) {
+    if(mode == "a") fp = open_file(zipname,"r+b");
+
+    if(fp) {
+        //zip file exists. we need to add new npy files to it.
+        //first read the footer. this gives us the offset and size of the global header
+        //then read and store the global header.
+        //new members are written from the start of the global header, which close() writes again after them.
+        size_t global_header_size;
+        parse_zip_footer(fp,nrecs,global_header_size,global_header_offset);
+        global_header.resize(global_header_size);
+        if(!seek_file(fp,global_header_offset) || !read_file(fp,global_header.data(),global_header_size)) {
+            fclose(fp);
+            throw std::runtime_error("npz_save: header read error while adding to existing zip");
+        }
+        seek_file(fp,global_header_offset);
+    }
+    else {
+        fp = open_file(zipname,"wb");
+    }
+    if(!fp) throw std::runtime_error("npz_save: Unable to open file "+zipname);
+}
+
+cnpy::NpzWriter::NpzWriter(std::vector<char>& buffer) :
+    zipname("memory buffer"), fp(NULL), memory(&buffer), memory_base(buffer.size()), nrecs(0), global_header_offset(0) { }
+
+bool cnpy::NpzWriter::put(const void* data, size_t nbytes) {
+    if(!memory) return write_file(fp,data,nbytes);
+    const char* bytes = static_cast<const char*>(data);
+    memory->insert(memory->end(),bytes,bytes + nbytes);
+    return true;
+}
+
+//in a file, writing then continues at resume
+bool cnpy::NpzWriter::patch_u32(size_t offset, uint32_t value, size_t resume) {
+    std::vector<char> bytes;
+    bytes += value;
+    if(memory) {
+        std::copy(bytes.begin(),bytes.end(),memory->begin() + memory_base + offset);
+        return true;
+    }
+    return seek_file(fp,offset) && write_file(fp,bytes.data(),4) && seek_file(fp,resume);
+}
+
+namespace {
+
+using cnpy::operator+=;
+
+//zip records of a member. fname carries the .npy suffix. sizes or offsets that do not fit 32 bits
+//go in a ZIP64 extra field, with 0xFFFFFFFF in their place
+struct ZipMember {
+    std::string fname;
+    uint16_t method;
+    uint32_t crc;
+    size_t compr_bytes;
+    size_t nbytes;
+    size_t offset; //of the local header
+    size_t padding; //bytes of the alignment field in the local header, 0 for none
+
+    //pad a stored member with an extra field, as zipalign does, so that its array data starts
+    //on a 64 byte boundary of the archive and NpzMap views of it are aligned
+    void align_data(size_t npy_header_bytes) {
+        const size_t alignment = 64;
+        padding = 0;
+        if(method != 0) return;
+        //the field is at least its 4 byte tag and length plus the 2 byte alignment
+        size_t data = offset + local_header_size() + npy_header_bytes + 6;
+        padding = (alignment - data % alignment) % alignment + 6;
+    }
+
+    bool zip64_sizes() const { return nbytes >= 0xFFFFFFFF || compr_bytes >= 0xFFFFFFFF; }
+    bool zip64_offset() const { return offset >= 0xFFFFFFFF; }
+
+    uint16_t version() const {
+        if(method == 93) return 63; //zstd needs version 6.3 to extract
+        return (zip64_sizes() || zip64_offset()) ? 45 : 20;
+    }
+
+    size_t local_header_size() const { return 30 + fname.size() + (zip64_sizes() ? 20 : 0) + padding; }
+
+    std::vector<char> local_header() const {
+        std::vector<char> local_header;
+        local_header += "PK"; //first part of sig
+        local_header += (uint16_t) 0x0403; //second part of sig
+        local_header += (uint16_t) version(); //min version to extract
+        local_header += (uint16_t) 0; //general purpose bit flag
+        local_header += (uint16_t) method; //compression method
+        local_header += (uint16_t) 0; //file last mod time
+        local_header += (uint16_t) 0;     //file last mod date
+        local_header += (uint32_t) crc; //crc
+        local_header += (uint32_t) (zip64_sizes() ? 0xFFFFFFFF : compr_bytes); //compressed size
+        local_header += (uint32_t) (zip64_sizes() ? 0xFFFFFFFF : nbytes); //uncompressed size
+        local_header += (uint16_t) fname.size(); //fname length
+        local_header += (uint16_t) ((zip64_sizes() ? 20 : 0) + padding); //extra field length
+        local_header += fname;
+        if(zip64_sizes()) {
+            //the local ZIP64 field always carries both sizes
+            local_header += (uint16_t) 0x0001; //ZIP64 extra field tag
+            local_header += (uint16_t) 16; //size of the extra field
+            local_header += (uint64_t) nbytes; //uncompressed size
+            local_header += (uint64_t) compr_bytes; //compressed size
+        }
+        if(padding) {
+            local_header += (uint16_t) 0xD935; //zipalign extra field tag
+            local_header += (uint16_t) (padding - 4); //size of the extra field
+            local_header += (uint16_t) 64; //alignment
+            local_header.insert(local_header.end(),padding - 6,0);
+        }
+        return local_header;
+    }
+
+    //append the central directory record
+    void central_record(std::vector<char>& global_header) const {
+        std::vector<char> extra;
+        if(zip64_sizes() || zip64_offset()) {
+            extra += (uint16_t) 0x0001; //ZIP64 extra field tag
+            extra += (uint16_t) ((zip64_sizes() ? 16 : 0) + (zip64_offset() ? 8 : 0)); //size of the extra field
+            if(zip64_sizes()) {
+                extra += (uint64_t) nbytes; //uncompressed size
+                extra += (uint64_t) compr_bytes; //compressed size
+            }
+            if(zip64_offset()) extra += (uint64_t) offset; //relative offset of local file header
+        }
+
+        std::vector<char> local = local_header();
+        global_header += "PK"; //first part of sig
+        global_header += (uint16_t) 0x0201; //second part of sig
+        global_header += (uint16_t) version(); //version made by
+        global_header.insert(global_header.end(),local.begin()+4,local.begin()+28);
+        global_header += (uint16_t) extra.size(); //extra field length
+        global_header += (uint16_t) 0; //file comment length
+        global_header += (uint16_t) 0; //disk number where file starts
+        global_header += (uint16_t) 0; //internal file attributes
+        global_header += (uint32_t) 0; //external file attributes
+        global_header += (uint32_t) (zip64_offset() ? 0xFFFFFFFF : offset); //relative offset of local file header
+        global_header += fname;
+        global_header.insert(global_header.end(),extra.begin(),extra.end());
+    }
+};
+
+//the end of central directory records of nrecs members, whose central directory of
+//global_header_size bytes starts at global_header_offset
+std::vector<char> zip_footer(size_t nrecs, size_t global_header_size, size_t global_header_offset) {
+    bool zip64 = nrecs >= 0xFFFF || global_header_size >= 0xFFFFFFFF || global_header_offset >= 0xFFFFFFFF;
+
+    std::vector<char> footer;
+    if(zip64) {
+        //ZIP64 end of central directory record, then the locator that points at it
+        size_t footer64_offset = global_header_offset + global_header_size;
+        footer += "PK"; //first part of sig
+        footer += (uint16_t) 0x0606; //second part of sig
+        footer += (uint64_t) 44; //size of the rest of this record
+        footer += (uint16_t) 45; //version made by
+        footer += (uint16_t) 45; //min version to extract
+        footer += (uint32_t) 0; //number of this disk
+        footer += (uint32_t) 0; //disk where central directory starts
+        footer += (uint64_t) nrecs; //number of records on this disk
+        footer += (uint64_t) nrecs; //total number of records
+        footer += (uint64_t) global_header_size; //nbytes of global headers
+        footer += (uint64_t) global_header_offset; //offset of start of global headers
+
+        footer += "PK"; //first part of sig
+        footer += (uint16_t) 0x0706; //second part of sig
+        footer += (uint32_t) 0; //disk with the ZIP64 end of central directory
+        footer += (uint64_t) footer64_offset; //offset of the ZIP64 end of central directory
+        footer += (uint32_t) 1; //total number of disks
+    }
+    footer += "PK"; //first part of sig
+    footer += (uint16_t) 0x0605; //second part of sig
+    footer += (uint16_t) 0; //number of this disk
+    footer += (uint16_t) 0; //disk where footer starts
+    footer += (uint16_t) (zip64 ? 0xFFFF : nrecs); //number of records on this disk
+    footer += (uint16_t) (zip64 ? 0xFFFF : nrecs); //total number of records
+    footer += (uint32_t) (zip64 ? 0xFFFFFFFF : global_header_size); //nbytes of global headers
+    footer += (uint32_t) (zip64 ? 0xFFFFFFFF : global_header_offset); //offset of start of global headers, right after the last member
+    footer += (uint16_t) 0; //zip file comment length
+    return footer;
+}
+
+}
+
+cnpy::NpzWriter::~NpzWriter() {
+    try { close(); }
+    catch(...) { }
+}
+
+uint32_t cnpy::NpzWriter::add_member(std::string fname, const std::vector<char>& npy_header, const void* data, size_t data_bytes,
+                                 const NpzCompression& compression)
+{
+    if(!fp && !memory) throw std::runtime_error("NpzWriter: "+zipname+" is closed");
+    if(!npz_compression_supported(compression.method))
+        throw std::runtime_error("npz_save: unsupported compression method "+std::to_string(compression.method));
+
+    //first, append a .npy to the fname
+    fname += ".npy";
+
+    size_t nbytes = data_bytes + npy_header.size();
+    size_t compr_bytes = nbytes;
+    uint32_t crc = 0;
+    std::vector<char> compressed;
+
+    //stored members are checksummed while they are written, and the crc patched into the local header after
+    if(compression.method == 8) {
+        deflate_npy(npy_header,static_cast<const char*>(data),data_bytes,compression,compressed,crc);
+        compr_bytes = compressed.size();
+    }
+#ifdef CNPY_HAVE_ZSTD
+    if(compression.method == 93) {
+        zstd_npy(npy_header,static_cast<const char*>(data),data_bytes,compression,compressed,crc);
+        compr_bytes = compressed.size();
+    }
+#endif
+
+    ZipMember member = {fname, compression.method, crc, compr_bytes, nbytes, global_header_offset, 0};
+    member.align_data(npy_header.size());
+    std::vector<char> local_header = member.local_header();
+
+    //write the member
+    bool ok = put(local_header.data(),local_header.size());
+    if(compression.method != 0) {
+        ok = ok && put(compressed.data(),compressed.size());
+    }
+    else {
+        crc = crc32_bytes(0,npy_header.data(),npy_header.size());
+        ok = ok && put(npy_header.data(),npy_header.size());
+        if(memory) {
+            crc = crc32_parallel(crc,data,data_bytes,compression.nthreads);
+            ok = ok && put(data,data_bytes);
+        }
+        else {
+            ok = ok && write_with_crc(fp,static_cast<const char*>(data),data_bytes,compression.nthreads,crc);
+        }
+
+        member.crc = crc;
+        ok = ok && patch_u32(global_header_offset+14,crc,global_header_offset+local_header.size()+compr_bytes);
+    }
+    if(!ok) throw std::runtime_error("npz_save: failed fwrite to "+zipname);
+
+    member.central_record(global_header);
+    nrecs++;
+    global_header_offset += local_header.size() + compr_bytes;
+    return crc;
+}
+
+void cnpy::NpzWriter::close() {
+    if(!fp && !memory) return;
+
+    std::vector<char> footer = zip_footer(nrecs,global_header.size(),global_header_offset);
+
+    //write everything
+    bool ok = put(global_header.data(),global_header.size());
+    ok = put(footer.data(),footer.size()) && ok;
+    if(memory) {
+        memory = NULL;
+        return;
+    }
+    ok = fclose(fp) == 0 && ok;
+    fp = NULL;
+    if(!ok) throw std::runtime_error("npz_save: failed to write central directory of "+zipname);
+}
+
+namespace {
+
+void pwrite_all(int fd, const char* data, size_t n, size_t at, const std::string& zipname) {
+    CNPY_IO_PHASE(cnpy::IO_WRITE,n);
+    while(n > 0) {
+        ssize_t res = pwrite(fd,data,std::min<size_t>(n, 1u << 30),at);
+        if(res < 0 && errno == EINTR) continue;
+        if(res <= 0) throw std::runtime_error("npz_save_all: failed write to "+zipname);
+        data += res;
+        at += res;
+        n -= res;
+    }
+}
+
+//a piece of one member, written and checksummed by one thread
+struct SavePiece {
+    size_t member;
+    const char* data;
+    size_t nbytes;
+    size_t offset;
+    uint32_t crc;
+};
+
+}
+
+void cnpy::npz_save_all(const std::string& zipname, const std::vector<NpzMemberView>& members, unsigned nthreads) {
+    //lay out the archive: each local header is followed by the npy header and data, then the central directory
+    std::vector<ZipMember> zip(members.size());
+    std::vector<SavePiece> pieces;
+    const size_t piece_bytes = 8 << 20;
+    size_t offset = 0;
+    for(size_t i = 0;i < members.size();i++) {
+        const NpzMemberView& m = members[i];
+        ZipMember z = {m.name + ".npy", 0, 0, m.npy_header.size() + m.data_bytes, m.npy_header.size() + m.data_bytes, offset, 0};
+        z.align_data(m.npy_header.size());
+        zip[i] = z;
+        offset += z.local_header_size();
+
+        SavePiece header = {i, m.npy_header.data(), m.npy_header.size(), offset, 0};
+        pieces.push_back(header);
+        offset += m.npy_header.size();
+        for(size_t done = 0;done < m.data_bytes;done += piece_bytes) {
+            SavePiece piece = {i, static_cast<const char*>(m.data) + done, std::min(piece_bytes, m.data_bytes - done), offset, 0};
+            pieces.push_back(piece);
+            offset += piece.nbytes;
+        }
+    }
+    size_t global_header_offset = offset;
+
+    int fd;
+    {
+        CNPY_IO_PHASE(IO_OPEN,0);
+        fd = open(zipname.c_str(),O_WRONLY | O_CREAT | O_TRUNC,0644);
+    }
+    if(fd < 0) throw std::runtime_error("npz_save_all: Unable to open file "+zipname);
+
+    try {
+        //the central directory size does not depend on the crcs, so the final size is known now.
+        //filesystems and systems without fallocate just grow the file as it is written
+        std::vector<char> global_header;
+        for(size_t i = 0;i < zip.size();i++) zip[i].central_record(global_header);
+        std::vector<char> footer = zip_footer(zip.size(),global_header.size(),global_header_offset);
+#ifdef __linux__
+        size_t total = global_header_offset + global_header.size() + footer.size();
+        if(total > 0 && fallocate(fd,0,0,total) != 0 && errno != EOPNOTSUPP && errno != ENOSYS)
+            throw std::runtime_error("npz_save_all: Unable to allocate "+std::to_string(total)+" bytes for "+zipname);
+#endif
+
+        parallel_for(pieces.size(), nthreads, [&](size_t i) {
+            SavePiece& p = pieces[i];
+            p.crc = crc32_bytes(0,p.data,p.nbytes);
+            pwrite_all(fd,p.data,p.nbytes,p.offset,zipname);
+        });
+
+        //pieces are in file order, so the crcs of each member join in order, starting from the empty crc 0
+        for(size_t i = 0;i < pieces.size();i++) {
+            ZipMember& z = zip[pieces[i].member];
+            z.crc = crc32_combine(z.crc,pieces[i].crc,pieces[i].nbytes);
+        }
+        std::vector<char> tail;
+        for(size_t i = 0;i < zip.size();i++) {
+            std::vector<char> local_header = zip[i].local_header();
+            pwrite_all(fd,local_header.data(),local_header.size(),zip[i].offset,zipname);
+            zip[i].central_record(tail);
+        }
+        tail.insert(tail.end(),footer.begin(),footer.end());
+        pwrite_all(fd,tail.data(),tail.size(),global_header_offset,zipname);
+    }
+    catch(...) {
+        ::close(fd);
+        throw;
+    }
+    if(::close(fd) != 0) throw std::runtime_error("npz_save_all: failed to write "+zipname);
+}
+
+size_t cnpy::npz_stored_size(const std::vector<NpzMemberView>& members) {
+    //the same layout as NpzWriter::add_member and close
+    size_t offset = 0;
+    std::vector<char> global_header;
+    for(size_t i = 0;i < members.size();i++) {
+        size_t nbytes = members[i].npy_header.size() + members[i].data_bytes;
+        ZipMember z = {members[i].name + ".npy", 0, 0, nbytes, nbytes, offset, 0};
+        z.align_data(members[i].npy_header.size());
+        z.central_record(global_header);
+        offset += z.local_header_size() + nbytes;
+    }
+    return offset + global_header.size() + zip_footer(members.size(),global_header.size(),offset).size();
+}
+
+cnpy::npz_t cnpy::npz_load_parallel(std::string fname, unsigned nthreads, bool verify_crc) {
+    std::vector<NpzEntry> entries = NpzReader(fname).entries();
+
+    int fd = open_fd(fname);
+    if(fd < 0) throw std::runtime_error("npz_load_parallel: Unable to open file "+fname);
+
+    std::vector<NpyArray> arrays(entries.size());
+    try {
+        parallel_for(entries.size(), nthreads, [&](size_t i) {
+            const NpzEntry& e = entries[i];
+            PreadSource src(fd,member_data_offset(fd,e,fname));
+            arrays[i] = load_the_member(src,e,verify_crc,fname);
+        });
+    }
+    catch(...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+
+    npz_t result;
+    for(size_t i = 0;i < entries.size();i++) result[entries[i].name] = arrays[i];
+    return result;
+}
+
+namespace {
+
+//collects the (file offset, length, destination) spans of a partial read in increasing file order.
+//spans separated by small gaps are merged into one pread through a scratch buffer, the rest are
+//read straight into their destination.
+class SpanReader {
+  public:
+    SpanReader(int _fd) : fd(_fd), group_start(0), group_end(0) { }
+
+    void add(size_t file_offset, size_t nbytes, char* dst) {
+        if(!group.empty() && (file_offset < group_end || file_offset - group_end > max_gap ||
+                              file_offset + nbytes - group_start > max_group)) flush();
+        if(group.empty()) group_start = file_offset;
+        Span span = {file_offset, nbytes, dst};
+        group.push_back(span);
+        group_end = file_offset + nbytes;
+    }
+
+    void flush() {
+        if(group.empty()) return;
+        if(group.size() == 1) {
+            PreadSource(fd,group[0].file_offset).read(group[0].dst,group[0].nbytes);
+        }
+        else {
+            scratch.resize(group_end - group_start);
+            PreadSource(fd,group_start).read(scratch.data(),scratch.size());
+            for(size_t i = 0;i < group.size();i++)
+                memcpy(group[i].dst,&scratch[group[i].file_offset - group_start],group[i].nbytes);
+        }
+        group.clear();
+    }
+
+  private:
+    struct Span {
+        size_t file_offset;
+        size_t nbytes;
+        char* dst;
+    };
+
+    static const size_t max_gap = 64 << 10;
+    static const size_t max_group = 8 << 20;
+
+    int fd;
+    std::vector<Span> group;
+    size_t group_start, group_end;
+    std::vector<char> scratch;
+};
+
+//read the block offsets[d] + i*strides[d], i < extents[d], out of the npy file at fd
+cnpy::NpyArray load_the_hyperslab(int fd, const std::string& fname, std::vector<size_t> offsets,
+                                  std::vector<size_t> extents, std::vector<size_t> strides) {
+    std::vector<size_t> shape;
+    size_t word_size;
+    bool fortran_order;
+    PreadSource src(fd,0);
+    size_t header_size = read_the_npy_header(src,word_size,shape,fortran_order);
+
+    size_t ndims = shape.size();
+    if(strides.empty()) strides.assign(ndims,1);
+    if(offsets.size() != ndims || extents.size() != ndims || strides.size() != ndims)
+        throw std::runtime_error("npy_load_slice: "+fname+" has "+std::to_string(ndims)+" dimensions");
+    for(size_t d = 0;d < ndims;d++) {
+        if(strides[d] == 0) throw std::runtime_error("npy_load_slice: strides must be positive");
+        if(extents[d] > 0 && offsets[d] + (extents[d]-1)*strides[d] >= shape[d])
+            throw std::runtime_error("npy_load_slice: slice is out of bounds of "+fname);
+    }
+
+    cnpy::NpyArray array(extents, word_size, fortran_order);
+    if(array.num_vals == 0) return array;
+
+    //work in storage order, slowest axis first
+    std::vector<size_t> dims = shape;
+    if(fortran_order) {
+        std::reverse(dims.begin(),dims.end());
+        std::reverse(offsets.begin(),offsets.end());
+        std::reverse(extents.begin(),extents.end());
+        std::reverse(strides.begin(),strides.end());
+    }
+    std::vector<size_t> file_stride(ndims,word_size);
+    for(size_t d = ndims;d-- > 1;) file_stride[d-1] = file_stride[d] * dims[d];
+
+    //trailing axes read whole, plus one more read partially with unit stride, form one contiguous run
+    size_t run_bytes = word_size;
+    size_t outer = ndims;
+    while(outer > 0 && strides[outer-1] == 1 && extents[outer-1] == dims[outer-1]) {
+        outer--;
+        run_bytes *= dims[outer];
+    }
+    if(outer > 0 && strides[outer-1] == 1) {
+        outer--;
+        run_bytes *= extents[outer];
+    }
+
+    size_t base = header_size;
+    for(size_t d = 0;d < ndims;d++) base += offsets[d] * file_stride[d];
+
+    //odometer over the outer axes
+    SpanReader reader(fd);
+    std::vector<size_t> index(outer,0);
+    char* dst = array.data<char>();
+    char* dst_end = dst + array.num_bytes();
+    for(;dst < dst_end;dst += run_bytes) {
+        size_t file_offset = base;
+        for(size_t d = 0;d < outer;d++) file_offset += index[d] * strides[d] * file_stride[d];
+        reader.add(file_offset,run_bytes,dst);
+
+        for(size_t d = outer;d-- > 0;) {
+            if(++index[d] < extents[d]) break;
+            index[d] = 0;
+        }
+    }
+    reader.flush();
+    return array;
+}
+
+}
+
+cnpy::NpyArray cnpy::npy_load_slice(std::string fname, const std::vector<size_t>& offsets, const std::vector<size_t>& extents,
+                                    const std::vector<size_t>& strides) {
+    int fd = open_fd(fname);
+    if(fd < 0) throw std::runtime_error("npy_load_slice: Unable to open file "+fname);
+    try {
+        NpyArray array = load_the_hyperslab(fd,fname,offsets,extents,strides);
+        close(fd);
+        return array;
+    }
+    catch(...) {
+        close(fd);
+        throw;
+    }
+}
+
+cnpy::NpyArray cnpy::npy_load_slice(std::string fname, size_t start, size_t count) {
+    int fd = open_fd(fname);
+    if(fd < 0) throw std::runtime_error("npy_load_slice: Unable to open file "+fname);
+    try {
+        std::vector<size_t> shape;
+        size_t word_size;
+        bool fortran_order;
+        PreadSource src(fd,0);
+        read_the_npy_header(src,word_size,shape,fortran_order);
+        if(shape.empty()) throw std::runtime_error("npy_load_slice: "+fname+" holds a scalar");
+
+        std::vector<size_t> offsets(shape.size(),0);
+        std::vector<size_t> extents = shape;
+        offsets[0] = start;
+        extents[0] = count;
+        if(start > shape[0] || count > shape[0] - start)
+            throw std::runtime_error("npy_load_slice: slice is out of bounds of "+fname);
+
+        NpyArray array = load_the_hyperslab(fd,fname,offsets,extents,std::vector<size_t>());
+        close(fd);
+        return array;
+    }
+    catch(...) {
+        close(fd);
+        throw;
+    }
+}
+
+namespace {
+
+//a few threads that run submitted tasks. tasks with the same key run one at a time in the order
+//they were submitted, tasks with different keys run concurrently
+class IoExecutor {
+  public:
+    IoExecutor() : stopping(false) {
+        //the threads spend their time blocked in the kernel, so have more of them than cores
+        unsigned nthreads = std::max(4u, std::thread::hardware_concurrency());
+        for(unsigned t = 0;t < nthreads;t++) workers.push_back(std::thread(&IoExecutor::work,this));
+    }
+
+    //finishes every queued task before returning
+    ~IoExecutor() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        ready.notify_all();
+        for(size_t t = 0;t < workers.size();t++) workers[t].join();
+    }
+
+    void submit(const std::string& key, const std::function<void()>& run) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            Task task = {key, run};
+            queue.push_back(task);
+        }
+        ready.notify_one();
+    }
+
+  private:
+    struct Task {
+        std::string key;
+        std::function<void()> run; //must not throw
+    };
+
+    void work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while(true) {
+            //the first queued task of a key is the oldest one, so this keeps each key in order
+            std::deque<Task>::iterator it = queue.begin();
+            while(it != queue.end() && busy.count(it->key)) ++it;
+            if(it == queue.end()) {
+                if(stopping && queue.empty()) return;
+                ready.wait(lock);
+                continue;
+            }
+
+            Task task = *it;
+            queue.erase(it);
+            busy.insert(task.key);
+            lock.unlock();
+            task.run();
+            lock.lock();
+            busy.erase(task.key);
+            //a task queued behind this one may be waiting for its key
+            ready.notify_all();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<Task> queue;
+    std::set<std::string> busy;
+    bool stopping;
+    std::vector<std::thread> workers;
+};
+
+IoExecutor& io_executor() {
+    static IoExecutor executor;
+    return executor;
+}
+
+}
+
+std::future<void> cnpy::async_io(const std::string& key, const std::function<void()>& task) {
+    std::shared_ptr<std::promise<void> > done = std::make_shared<std::promise<void> >();
+    std::future<void> result = done->get_future();
+    io_executor().submit(key,[done,task]() {
+        try {
+            task();
+            done->set_value();
+        }
+        catch(...) {
+            done->set_exception(std::current_exception());
+        }
+    });
+    return result;
+}
+
+std::future<cnpy::NpyArray> cnpy::npy_load_async(std::string fname) {
+    std::shared_ptr<std::promise<NpyArray> > done = std::make_shared<std::promise<NpyArray> >();
+    std::future<NpyArray> result = done->get_future();
+    io_executor().submit(fname,[done,fname]() {
+        try {
+            done->set_value(npy_load(fname));
+        }
+        catch(...) {
+            done->set_exception(std::current_exception());
+        }
+    });
+    return result;
+}
+
+namespace {
+
+//a file read with one pread of up to capacity bytes into head, and pread for whatever is past it
+class HeadSource : public ByteSource {
+  public:
+    HeadSource(int fd, char* _head, size_t capacity) : head(_head), have(0), at(0), rest(fd,0) {
+        while(have < capacity) {
+            ssize_t res;
+            {
+                CNPY_IO_PHASE(cnpy::IO_READ,capacity - have);
+                res = pread(fd,head + have,capacity - have,have);
+            }
+            if(res < 0 && errno == EINTR) continue;
+            if(res < 0) throw std::runtime_error("load_the_npy_file: failed pread");
+            have += res;
+            if(res == 0 || have < capacity) break; //a short read of a regular file is its end
+        }
+        rest.skip(have);
+    }
+
+    void read(void* dst, size_t n) {
+        size_t from_head = std::min(n, have - at);
+        memcpy(dst,head + at,from_head);
+        at += from_head;
+        if(n > from_head) rest.read(static_cast<char*>(dst) + from_head,n - from_head);
+    }
+
+    void skip(size_t n) {
+        size_t from_head = std::min(n, have - at);
+        at += from_head;
+        rest.skip(n - from_head);
+    }
+
+  private:
+    char* head;
+    size_t have;
+    size_t at;
+    PreadSource rest;
+};
+
+}
+
+cnpy::NpyLoadMany::NpyLoadMany(const std::vector<std::string>& _fnames, size_t _queue_depth, bool _in_order, const Allocator& _allocator) :
+    fnames(_fnames), queue_depth(std::max<size_t>(_queue_depth, 1)), in_order(_in_order), allocator(_allocator),
+    claimed(0), delivered(0), stopping(false) {
+    size_t nthreads = std::min(queue_depth, fnames.size());
+    for(size_t t = 0;t < nthreads;t++) threads.push_back(std::thread([this]() { work(); }));
+}
+
+cnpy::NpyLoadMany::~NpyLoadMany() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    space.notify_all();
+    for(size_t t = 0;t < threads.size();t++) threads[t].join();
+    for(size_t i = 0;i < opened.size();i++) if(opened[i].fd >= 0) ::close(opened[i].fd);
+}
+
+void cnpy::NpyLoadMany::work() {
+    std::vector<char> head(1 << 16);
+    std::unique_lock<std::mutex> lock(mutex);
+    for(;;) {
+        //open the files ahead of the one read next, and start their readahead
+        while(!stopping && opened.size() < queue_depth && claimed < fnames.size() && claimed - delivered < 4*queue_depth) {
+            size_t index = claimed++;
+            lock.unlock();
+            int fd = open_fd(fnames[index]);
+#ifdef POSIX_FADV_WILLNEED
+            if(fd >= 0) posix_fadvise(fd,0,0,POSIX_FADV_WILLNEED);
+#endif
+            lock.lock();
+            Opened o = {index, fd};
+            opened.push_back(o);
+            space.notify_one();
+        }
+        if(stopping) return;
+        if(opened.empty()) {
+            if(claimed == fnames.size()) return;
+            space.wait(lock);
+            continue;
+        }
+
+        Opened o = opened.front();
+        opened.pop_front();
+        lock.unlock();
+        Loaded result;
+        try {
+            if(o.fd < 0) throw std::runtime_error("npy_load_many: Unable to open file "+fnames[o.index]);
+            HeadSource src(o.fd,head.data(),head.size());
+            if(allocator) {
+                Allocator& allocate = allocator;
+                size_t index = o.index;
+                result.array = load_the_npy(src,[&allocate,index](size_t nbytes) { return allocate(index,nbytes); });
+            }
+            else {
+                result.array = load_the_npy(src);
+            }
+        }
+        catch(...) {
+            result.error = std::current_exception();
+        }
+        if(o.fd >= 0) ::close(o.fd);
+        lock.lock();
+        loaded[o.index] = result;
+        if(!in_order || o.index == delivered) ready.notify_one();
+    }
+}
+
+bool cnpy::NpyLoadMany::next(NpyArray& array, size_t& index) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if(delivered == fnames.size()) return false;
+    if(in_order) ready.wait(lock,[this]() { return loaded.count(delivered) > 0; });
+    else ready.wait(lock,[this]() { return !loaded.empty(); });
+
+    std::map<size_t, Loaded>::iterator it = in_order ? loaded.find(delivered) : loaded.begin();
+    index = it->first;
+    Loaded result = it->second;
+    loaded.erase(it);
+    delivered++;
+    lock.unlock();
+    space.notify_one(); //room for one more file
+
+    if(result.error) std::rethrow_exception(result.error);
+    array = result.array;
+    return true;
+}
+
+std::vector<cnpy::NpyArray> cnpy::npy_load_many(const std::vector<std::string>& fnames, size_t queue_depth) {
+    std::vector<NpyArray> arrays(fnames.size());
+    NpyLoadMany loader(fnames,queue_depth,false);
+    NpyArray array;
+    size_t index;
+    while(loader.next(array,index)) arrays[index] = array;
+    return arrays;
+}
+
+cnpy::NpyArray cnpy::npy_load_stacked(const std::vector<std::string>& fnames, size_t queue_depth) {
+    if(fnames.empty()) throw std::runtime_error("npy_load_stacked: no files to load");
+    NpyInfo first = npy_info(fnames[0]);
+    if(first.fortran_order) throw std::runtime_error("npy_load_stacked: "+fnames[0]+" is in Fortran order");
+    size_t nbytes = first.word_size;
+    for(size_t i = 0;i < first.shape.size();i++) nbytes *= first.shape[i];
+
+    //every file is read straight into its place in the arena
+    std::shared_ptr<NpyStorage> arena = default_allocate(nbytes * fnames.size());
+    std::string mismatch = "npy_load_stacked: the shape or dtype of ";
+    NpyLoadMany loader(fnames,queue_depth,false,[&](size_t index, size_t n) -> std::shared_ptr<NpyStorage> {
+        if(n != nbytes) throw std::runtime_error(mismatch+fnames[index]+" differs from "+fnames[0]);
+        return std::make_shared<NpyStorageView>(arena,index*nbytes,nbytes);
+    });
+    NpyArray array;
+    size_t index;
+    while(loader.next(array,index)) {
+        if(array.shape != first.shape || array.word_size != first.word_size || array.fortran_order)
+            throw std::runtime_error(mismatch+fnames[index]+" differs from "+fnames[0]);
+    }
+
+    std::vector<size_t> shape(1,fnames.size());
+    shape.insert(shape.end(),first.shape.begin(),first.shape.end());
+    return NpyArray(shape,first.word_size,false,arena);
+}
+
+cnpy::ConcurrentSink::ConcurrentSink(const Consumer& _consume) : consume(_consume), head(NULL), closing(false) {
+    thread = std::thread([this]() { run(); });
+}
+
+cnpy::ConcurrentSink::~ConcurrentSink() {
+    try { close(); }
+    catch(...) { }
+}
+
+void cnpy::ConcurrentSink::push(const std::string& name, std::vector<char>& batch, size_t header_bytes) {
+    if(closing) throw std::runtime_error("ConcurrentSink: push after close");
+    Batch* b = new Batch;
+    b->name = name;
+    b->data.swap(batch);
+    b->header_bytes = header_bytes;
+
+    Batch* old = head.load();
+    do {
+        b->next = old;
+    } while(!head.compare_exchange_weak(old,b));
+
+    //only a push onto an empty list can find the I/O thread asleep. taking the mutex orders this push
+    //before or after its check of the list, so the notify cannot be missed
+    if(!old) {
+        { std::lock_guard<std::mutex> lock(wake_mutex); }
+        wake.notify_one();
+    }
+}
+
+void cnpy::ConcurrentSink::close() {
+    if(!thread.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        closing = true;
+    }
+    wake.notify_one();
+    thread.join();
+    if(error) {
+        std::exception_ptr e = error;
+        error = std::exception_ptr();
+        std::rethrow_exception(e);
+    }
+}
+
+void cnpy::ConcurrentSink::run() {
+    for(;;) {
+        Batch* taken;
+        {
+            std::unique_lock<std::mutex> lock(wake_mutex);
+            wake.wait(lock,[this]() { return head.load() != NULL || closing; });
+            taken = head.exchange(NULL);
+        }
+        if(!taken) return;
+
+        //the list is newest first
+        Batch* ordered = NULL;
+        while(taken) {
+            Batch* next = taken->next;
+            taken->next = ordered;
+            ordered = taken;
+            taken = next;
+        }
+        while(ordered) {
+            Batch* b = ordered;
+            ordered = b->next;
+            if(!error) {
+                try { consume(b->name,b->data,b->header_bytes); }
+                catch(...) { error = std::current_exception(); }
+            }
+            delete b;
+        }
+    }
+}
+
+cnpy::NpzConcurrentWriter::NpzConcurrentWriter(const std::string& zipname, const std::string& mode, const NpzCompression& _compression) :
+    writer(zipname,mode), compression(_compression), sink([this](const std::string& fname, std::vector<char>& member, size_t header_bytes) {
+        std::vector<char> npy_header(member.begin(),member.begin() + header_bytes);
+        writer.add_member(fname,npy_header,member.data() + header_bytes,member.size() - header_bytes,compression);
+    }) { }
+
+cnpy::NpzConcurrentWriter::~NpzConcurrentWriter() {
+    try { close(); }
+    catch(...) { }
+}
+
+void cnpy::NpzConcurrentWriter::close() {
+    sink.close();
+    writer.close();
+}
@@ -10,37 +10,147 @@
 #include<sstream>
 #include<vector>
 #include<cstdio>
+#include<cstddef>
 #include<typeinfo>
 #include<iostream>
 #include<cassert>
 #include<zlib.h>
 #include<map>
+#include<list>
+#include<deque>
+#include<unordered_map>
 #include<memory>
+#include<functional>
+#include<future>
+#include<atomic>
+#include<thread>
+#include<mutex>
+#include<condition_variable>
 #include<stdint.h>
 #include<numeric>
+#include<algorithm>
+#include<type_traits>
+#include<complex>
+
+//the byte order of the build, for the descr of every array written. compilers without
+//__BYTE_ORDER__ (MSVC) only target little-endian machines
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define CNPY_BYTE_ORDER '>'
+#else
+#define CNPY_BYTE_ORDER '<'
+#endif
 
 namespace cnpy {
 
+    //the bytes behind an NpyArray. either owned (NpyVectorStorage), a mapping of a
+    //file (NpyMappedFile) or a window into another storage (NpyStorageView).
+    struct NpyStorage {
+        virtual ~NpyStorage() { }
+        virtual char* data() = 0;
+        virtual size_t size() const = 0;
+    };
+
+    struct NpyVectorStorage : public NpyStorage {
+        explicit NpyVectorStorage(size_t nbytes) : bytes(nbytes) { }
+        char* data() { return bytes.data(); }
+        size_t size() const { return bytes.size(); }
+
+        std::vector<char> bytes;
+    };
+
+    //heap memory aligned to alignment bytes and left uninitialized
+    class NpyAlignedStorage : public NpyStorage {
+      public:
+        explicit NpyAlignedStorage(size_t nbytes, size_t alignment = 64);
+        ~NpyAlignedStorage();
+        char* data() { return addr; }
+        size_t size() const { return nbytes; }
+
+      private:
+        NpyAlignedStorage(const NpyAlignedStorage&);
+        NpyAlignedStorage& operator=(const NpyAlignedStorage&);
+
+        char* addr;
+        size_t nbytes;
+    };
+
+    //memory owned by the caller, who must keep it alive as long as the array
+    struct NpyBufferStorage : public NpyStorage {
+        NpyBufferStorage(char* _addr, size_t _nbytes) : addr(_addr), nbytes(_nbytes) { }
+        char* data() { return addr; }
+        size_t size() const { return nbytes; }
+
+        char* addr;
+        size_t nbytes;
+    };
+
+    //maps a whole file into memory. read-only mappings are shared with the page cache;
+    //copy_on_write mappings may be modified without the changes reaching the file.
+    class NpyMappedFile : public NpyStorage {
+      public:
+        NpyMappedFile(const std::string& fname, bool copy_on_write = false);
+        ~NpyMappedFile();
+        char* data() { return addr; }
+        size_t size() const { return length; }
+
+      private:
+        NpyMappedFile(const NpyMappedFile&);
+        NpyMappedFile& operator=(const NpyMappedFile&);
+
+        char* addr;
+        size_t length;
+    };
+
+    //nbytes starting at offset inside parent. keeps parent alive.
+    struct NpyStorageView : public NpyStorage {
+        NpyStorageView(const std::shared_ptr<NpyStorage>& _parent, size_t _offset, size_t _nbytes) :
+            parent(_parent), offset(_offset), nbytes(_nbytes) { }
+        char* data() { return parent->data() + offset; }
+        size_t size() const { return nbytes; }
+
+        std::shared_ptr<NpyStorage> parent;
+        size_t offset;
+        size_t nbytes;
+    };
+
+    //returns storage of at least nbytes for a load to read into. lets callers place loaded
+    //arrays in pinned, huge-page or otherwise special memory.
+    typedef std::function<std::shared_ptr<NpyStorage>(size_t nbytes)> NpyAllocator;
+
+    NpyAllocator aligned_allocator(size_t alignment = 64);
+    //hands out dst, throwing if the array needs more than capacity bytes
+    NpyAllocator buffer_allocator(void* dst, size_t capacity);
+
     struct NpyArray {
         NpyArray(const std::vector<size_t>& _shape, size_t _word_size, bool _fortran_order) :
             shape(_shape), word_size(_word_size), fortran_order(_fortran_order)
         {
             num_vals = 1;
             for(size_t i = 0;i < shape.size();i++) num_vals *= shape[i];
-            data_holder = std::shared_ptr<std::vector<char>>(
-                new std::vector<char>(num_vals * word_size));
+            data_holder = std::make_shared<NpyVectorStorage>(num_vals * word_size);
+        }
+
+        //wrap existing storage, which must hold at least num_vals*word_size bytes
+        NpyArray(const std::vector<size_t>& _shape, size_t _word_size, bool _fortran_order,
+                 const std::shared_ptr<NpyStorage>& _data_holder) :
+            data_holder(_data_holder), shape(_shape), word_size(_word_size), fortran_order(_fortran_order)
+        {
+            num_vals = 1;
+            for(size_t i = 0;i < shape.size();i++) num_vals *= shape[i];
+            if(data_holder->size() < num_vals * word_size)
+                throw std::runtime_error("NpyArray: storage is smaller than the array");
         }
 
         NpyArray() : shape(0), word_size(0), fortran_order(0), num_vals(0) { }
 
         template<typename T>
         T* data() {
-            return reinterpret_cast<T*>(&(*data_holder)[0]);
+            return reinterpret_cast<T*>(data_holder->data());
         }
 
         template<typename T>
         const T* data() const {
-            return reinterpret_cast<T*>(&(*data_holder)[0]);
+            return reinterpret_cast<const T*>(data_holder->data());
         }
 
         template<typename T>
@@ -50,10 +160,10 @@ namespace cnpy {
         }
 
         size_t num_bytes() const {
-            return data_holder->size();
+            return num_vals * word_size;
         }
 
-        std::shared_ptr<std::vector<char>> data_holder;
+        std::shared_ptr<NpyStorage> data_holder;
         std::vector<size_t> shape;
         size_t word_size;
         bool fortran_order;
@@ -62,15 +172,415 @@ namespace cnpy {
    
     using npz_t = std::map<std::string, NpyArray>; 
 
+    //what the header of a .npy, or of a .npz member, says about the array
+    struct NpyInfo {
+        std::string descr; //dtype descriptor, e.g. "<f8"
+        std::vector<size_t> shape;
+        size_t word_size;
+        bool fortran_order;
+        size_t header_size; //bytes of npy header before the data
+        size_t data_offset; //file offset of the data, or of the compressed stream for deflated members
+        uint16_t compr_method; //zip compression method, 0 for .npy files
+        size_t compr_bytes; //bytes on disk, npy header included
+        size_t uncompr_bytes; //npy header plus data
+    };
+
+    //one record of a .npz central directory
+    struct NpzEntry {
+        std::string name; //without the trailing .npy
+        uint16_t compr_method;
+        uint32_t crc;
+        size_t compr_bytes;
+        size_t uncompr_bytes;
+        size_t local_header_offset;
+    };
+
+    //keeps a .npz open and indexes its central directory once, so repeated get() calls
+    //seek straight to the member. not safe to share between threads.
+    //with verify_crc, get() checks each member against the crc32 in the central directory.
+    class NpzReader {
+      public:
+        explicit NpzReader(const std::string& fname, bool verify_crc = false);
+        ~NpzReader();
+
+        bool contains(const std::string& varname) const;
+        std::vector<std::string> names() const;
+        const NpzEntry& entry(const std::string& varname) const;
+        const std::vector<NpzEntry>& entries() const { return members; }
+        NpyArray get(const std::string& varname);
+        NpyArray get(const std::string& varname, const NpyAllocator& allocator);
+        //get(varname) converted to T, see npy_load_as
+        template<typename T> NpyArray get_as(const std::string& varname);
+        NpyArray get_as(const std::string& varname, char type, size_t word_size);
+        //read only the npy header of a member
+        NpyInfo info(const std::string& varname);
+        //whether varname was stored with NpzWriter::add_chunked
+        bool is_chunked(const std::string& varname) const;
+        //rows [start, start+count) of a chunked array, inflating only the chunks they fall in, on
+        //nthreads threads (0 = one per core). get(varname) returns a whole chunked array the same way
+        NpyArray get_rows(const std::string& varname, size_t start, size_t count, unsigned nthreads = 0);
+
+      private:
+        NpzReader(const NpzReader&);
+        NpzReader& operator=(const NpzReader&);
+
+        size_t seek_to_data(const std::string& varname);
+        NpyArray load_chunked(const std::string& varname, size_t start, size_t count, bool all_rows, unsigned nthreads,
+                              const NpyAllocator& allocator);
+
+        std::string fname;
+        bool verify_crc;
+        FILE* fp;
+        std::vector<NpzEntry> members;
+        std::vector<size_t> data_offsets; //0 until the local header has been read
+        std::unordered_map<std::string, size_t> index;
+    };
+
+    //maps a .npz archive once. stored members are returned as views into the mapping,
+    //deflated members are decompressed into their own buffer on every get().
+    //cnpy pads stored members so their data is 64 byte aligned in the archive; members written by
+    //other tools, such as numpy.savez, may give unaligned views. NpzReader::get copies into aligned memory
+    class NpzMap {
+      public:
+        explicit NpzMap(const std::string& fname, bool copy_on_write = false, bool verify_crc = false);
+        //an archive already in memory, kept alive by the map
+        explicit NpzMap(const std::shared_ptr<NpyStorage>& buffer, bool verify_crc = false);
+
+        bool contains(const std::string& varname) const;
+        std::vector<std::string> names() const;
+        NpyArray get(const std::string& varname) const;
+        NpyArray operator[](const std::string& varname) const { return get(varname); }
+        //whether get(varname) decompresses rather than returning a view
+        bool is_compressed(const std::string& varname) const;
+
+      private:
+        void index_members();
+
+        struct Member {
+            uint32_t crc;
+            uint16_t compr_method;
+            size_t data_offset;
+            size_t compr_bytes;
+            size_t uncompr_bytes;
+        };
+
+        std::string fname;
+        bool verify_crc;
+        std::shared_ptr<NpyStorage> file;
+        std::map<std::string, Member> members;
+    };
+
+    //a .npz handle for long-running readers that touch a few members of many archives. nothing is
+    //read until a member is asked for: stored members are views into a mapping of the archive
+    //(NpzMap) and cost no memory of their own, deflated ones are decompressed on first access and
+    //cached. once the cached arrays exceed budget_bytes (0 = no limit), the least recently used are
+    //dropped; arrays already handed out stay valid. safe to use from several threads
+    class NpzLazy {
+      public:
+        explicit NpzLazy(const std::string& fname, size_t budget_bytes = 0, bool verify_crc = false);
+
+        bool contains(const std::string& varname) const { return archive.contains(varname); }
+        std::vector<std::string> names() const { return archive.names(); }
+        NpyArray get(const std::string& varname);
+        NpyArray operator[](const std::string& varname) { return get(varname); }
+
+        //bytes held by the cache
+        size_t cached_bytes() const;
+        void clear();
+
+      private:
+        NpzLazy(const NpzLazy&);
+        NpzLazy& operator=(const NpzLazy&);
+
+        typedef std::list<std::pair<std::string, NpyArray> > Lru;
+
+        NpzMap archive;
+        size_t budget;
+        mutable std::mutex mutex;
+        Lru lru; //most recently used first
+        std::unordered_map<std::string, Lru::iterator> cache;
+        size_t cached;
+    };
+
+    //the kinds of work IoStats accounts for
+    enum IoPhase { IO_OPEN, IO_SEEK, IO_READ, IO_WRITE, IO_HEADER, IO_INFLATE, IO_DEFLATE, IO_CRC, IO_NUM_PHASES };
+
+    //per phase: how often it was entered (one open, fread, fwrite, fseek, ... call each), the bytes
+    //it handled, and the time spent in it. io_stats() holds the totals for the calling thread, with
+    //the work of threads started by a parallel call added to the thread that made it.
+    //only collected when cnpy is built with CNPY_ENABLE_STATS; otherwise it stays zero and the hooks
+    //are compiled out.
+    struct IoStats {
+        IoStats() {
+            for(int i = 0;i < IO_NUM_PHASES;i++) calls[i] = bytes[i] = nanoseconds[i] = 0;
+        }
+        uint64_t calls[IO_NUM_PHASES];
+        uint64_t bytes[IO_NUM_PHASES];
+        uint64_t nanoseconds[IO_NUM_PHASES];
+    };
+
+    IoStats& io_stats();
+    void reset_io_stats();
+    const char* io_phase_name(IoPhase phase);
+
+    //called on the working thread when a phase begins and when it ends. set it before starting any I/O
+    typedef std::function<void(IoPhase phase, bool begin, size_t bytes)> IoTrace;
+    void set_io_trace(const IoTrace& trace);
+
+#ifdef CNPY_ENABLE_STATS
+    //accounts one phase to io_stats() from construction to destruction
+    class IoPhaseTimer {
+      public:
+        IoPhaseTimer(IoPhase phase, size_t bytes);
+        ~IoPhaseTimer();
+
+      private:
+        IoPhase phase;
+        size_t bytes;
+        uint64_t start;
+    };
+    #define CNPY_IO_PHASE(phase,bytes) cnpy::IoPhaseTimer cnpy_io_phase_timer(phase,bytes)
+    //for phases whose byte count is only known at the end
+    #define CNPY_IO_ADD_BYTES(phase,n) (cnpy::io_stats().bytes[phase] += (n))
+#else
+    #define CNPY_IO_PHASE(phase,bytes) do { } while(0)
+    #define CNPY_IO_ADD_BYTES(phase,n) do { } while(0)
+#endif
+
+    //how npz_save stores a member. method is the zip compression method: 0 (stored), 8 (deflate) or
+    //93 (zstd, when cnpy is built with libzstd). deflated payloads larger than block_size are split into
+    //blocks that are compressed on nthreads workers (0 = one per core) and joined with sync flushes, as
+    //pigz does. for zstd, level is a zstd level (Z_DEFAULT_COMPRESSION picks zstd's default) and
+    //payloads larger than block_size are compressed by nthreads zstd workers.
+    struct NpzCompression {
+        NpzCompression(uint16_t _method = 0, int _level = Z_DEFAULT_COMPRESSION, unsigned _nthreads = 0, size_t _block_size = 1 << 20) :
+            method(_method), level(_level), nthreads(_nthreads), block_size(_block_size) { }
+
+        uint16_t method;
+        int level;
+        unsigned nthreads;
+        size_t block_size;
+    };
+
+    //whether this build of cnpy can write and read members with compression method
+    bool npz_compression_supported(uint16_t method);
+
     char BigEndianTest();
     char map_type(const std::type_info& t);
-    template<typename T> std::vector<char> create_npy_header(const std::vector<size_t>& shape);
+
+    //one field of a structured dtype: its descr (a quoted scalar such as '<f8', or the list of a
+    //nested record), the shape of a fixed size array field, and where it sits in the struct
+    struct NpyField {
+        std::string name;
+        std::string descr;
+        std::vector<size_t> shape;
+        size_t offset;
+        size_t size;
+    };
+
+    //the NumPy descr list of a record of itemsize bytes with fields, with the gaps between and after
+    //them written as unnamed void fields, as NumPy does for aligned structs
+    std::string npy_record_descr(const std::vector<NpyField>& fields, size_t itemsize);
+
+    //structs written as records. specialize with CNPY_RECORD(Struct, CNPY_FIELD(Struct, member), ...)
+    //at global scope; npy_save, npz_save, NpyWriter and the rest then write arrays of Struct in one
+    //piece as a NumPy record array, and npy_load(...).data<Struct>() reads them back
+    template<typename T> struct NpyRecord {
+        static const bool defined = false;
+    };
+
+    //the NumPy kind of a scalar T, as map_type gives it at run time, or '?' if it has none
+    template<typename T> struct NpyKind {
+        static const char value = std::is_same<T, bool>::value ? 'b' :
+                                  std::is_floating_point<T>::value ? 'f' :
+                                  std::is_same<T, char>::value || (std::is_integral<T>::value && std::is_signed<T>::value) ? 'i' :
+                                  std::is_integral<T>::value ? 'u' : '?';
+    };
+
+    template<typename T> struct NpyKind<std::complex<T> > {
+        static const char value = std::is_floating_point<T>::value ? 'c' : '?';
+    };
+
+    //the quoted descr of a scalar T, such as '<f8', made at compile time. a T without a NumPy
+    //dtype is a compile error instead of a '?' in the file
+    template<typename T> struct NpyDtype {
+        static_assert(NpyKind<T>::value != '?', "cnpy: T has no NumPy dtype, use an arithmetic type, std::complex or a CNPY_RECORD struct");
+        static constexpr char descr[] = {'\'', CNPY_BYTE_ORDER, NpyKind<T>::value,
+                                         (char) ('0' + (sizeof(T) >= 10 ? sizeof(T) / 10 : sizeof(T))),
+                                         sizeof(T) >= 10 ? (char) ('0' + sizeof(T) % 10) : '\'',
+                                         sizeof(T) >= 10 ? '\'' : '\0', '\0'};
+        static constexpr size_t descr_len = sizeof(T) >= 10 ? 6 : 5;
+    };
+
+    template<typename T> constexpr char NpyDtype<T>::descr[];
+    template<typename T> constexpr size_t NpyDtype<T>::descr_len;
+
+    //the descr of T as it goes in a header, made once per type
+    template<typename T, bool record = NpyRecord<T>::defined> struct NpyDescr {
+        static const std::string& get() {
+            static const std::string descr(NpyDtype<T>::descr,NpyDtype<T>::descr_len);
+            return descr;
+        }
+    };
+
+    template<typename T> struct NpyDescr<T, true> {
+        static const std::string& get() {
+            static const std::string descr = npy_record_descr(NpyRecord<T>::fields(),sizeof(T));
+            return descr;
+        }
+    };
+
+    template<typename T> struct NpyExtents {
+        static void get(std::vector<size_t>&) { }
+    };
+
+    template<typename T, size_t N> struct NpyExtents<T[N]> {
+        static void get(std::vector<size_t>& shape) {
+            shape.push_back(N);
+            NpyExtents<T>::get(shape);
+        }
+    };
+
+    //field name of type F at offset. F may be a scalar, a record, or a fixed size array of either
+    template<typename F> NpyField npy_field(const std::string& name, size_t offset) {
+        NpyField field;
+        field.name = name;
+        field.descr = NpyDescr<typename std::remove_all_extents<F>::type>::get();
+        NpyExtents<F>::get(field.shape);
+        field.offset = offset;
+        field.size = sizeof(F);
+        return field;
+    }
+
+    template<typename T> std::vector<char> create_npy_header(const std::vector<size_t>& shape, size_t header_size = 0, bool fortran_order = false);
+
+    //write the npy header of an array of ndims axes with dtype descr (quoted, as NpyDescr gives it) to
+    //out if it has capacity for it, and return its size either way, like snprintf. header_size is as
+    //for create_npy_header. 256 bytes hold the header of any scalar dtype with up to eight axes
+    size_t write_npy_header(char* out, size_t capacity, const char* descr, size_t descr_len, const size_t* shape, size_t ndims,
+                            bool fortran_order = false, size_t header_size = 0);
+
+    //create_npy_header<T>(shape,0,fortran_order), reusing the header of the previous call on this
+    //thread when it was for the same shape, as when saving many arrays of one shape in a loop.
+    //the reference is valid until the next call for T on the same thread
+    template<typename T> const std::vector<char>& npy_header_cached(const std::vector<size_t>& shape, bool fortran_order = false) {
+        struct Cached {
+            std::vector<size_t> shape;
+            bool fortran_order;
+            std::vector<char> header;
+        };
+        static thread_local Cached last;
+        if(last.header.empty() || last.fortran_order != fortran_order || last.shape != shape) {
+            last.header = create_npy_header<T>(shape,0,fortran_order);
+            last.shape = shape;
+            last.fortran_order = fortran_order;
+        }
+        return last.header;
+    }
     void parse_npy_header(FILE* fp,size_t& word_size, std::vector<size_t>& shape, bool& fortran_order);
     void parse_npy_header(unsigned char* buffer,size_t& word_size, std::vector<size_t>& shape, bool& fortran_order);
+    void parse_zip_footer(FILE* fp, size_t& nrecs, size_t& global_header_size, size_t& global_header_offset);
     void parse_zip_footer(FILE* fp, uint16_t& nrecs, size_t& global_header_size, size_t& global_header_offset);
     npz_t npz_load(std::string fname);
     NpyArray npz_load(std::string fname, std::string varname);
+    //npz_load(fname), with members read by pread and inflated on nthreads threads (0 = one per core)
+    npz_t npz_load_parallel(std::string fname, unsigned nthreads = 0, bool verify_crc = false);
+    //name of member i of an array stored by NpzWriter::add_chunked
+    std::string npz_chunk_name(const std::string& varname, size_t i);
+    //shape and dtype from only the header of a .npy
+    NpyInfo npy_info(std::string fname);
+    //the same for every member of a .npz, reading only its central directory and the npy headers
+    std::map<std::string, NpyInfo> npz_list(std::string fname);
     NpyArray npy_load(std::string fname);
+    NpyArray npy_load(std::string fname, const NpyAllocator& allocator);
+    NpyArray npy_load_into(std::string fname, void* dst, size_t capacity);
+    //npy_load with the data converted from the type in the header to type and word_size (as in a descr
+    //such as "<f4"): byte-swapped, widened, narrowed, or cast between integer and floating point.
+    //complex arrays only convert to complex. out of range float to integer casts are undefined, as in C++
+    NpyArray npy_load_as(std::string fname, char type, size_t word_size);
+    template<typename T> NpyArray npy_load_as(std::string fname) {
+        return npy_load_as(fname,NpyKind<T>::value,sizeof(T));
+    }
+    template<typename T> NpyArray NpzReader::get_as(const std::string& varname) {
+        return get_as(varname,NpyKind<T>::value,sizeof(T));
+    }
+    //run task on the library's I/O threads, after every earlier task submitted with the same key
+    //(the name of the file it touches) and concurrently with tasks for other files
+    std::future<void> async_io(const std::string& key, const std::function<void()>& task);
+    //npy_load on the I/O threads
+    std::future<NpyArray> npy_load_async(std::string fname);
+
+    //loads a list of .npy files, for datasets of many small files where each npy_load waits on its
+    //own open and reads in turn. queue_depth threads read files at once, while the next queue_depth
+    //files are already open and the kernel asked (posix_fadvise WILLNEED) to read them ahead. small
+    //files take one pread. next() returns arrays in the order of fnames, or with in_order = false in
+    //the order they finish; at most 4*queue_depth are loaded ahead of the caller. a file that fails
+    //to load throws from the next() that would have returned it, and the rest still load
+    class NpyLoadMany {
+      public:
+        //the storage for the nbytes of file index
+        typedef std::function<std::shared_ptr<NpyStorage>(size_t index, size_t nbytes)> Allocator;
+
+        NpyLoadMany(const std::vector<std::string>& fnames, size_t queue_depth = 16, bool in_order = true,
+                    const Allocator& allocator = Allocator());
+        ~NpyLoadMany();
+
+        //the next array and the index of its file in fnames. false once every file has been returned
+        bool next(NpyArray& array, size_t& index);
+
+      private:
+        NpyLoadMany(const NpyLoadMany&);
+        NpyLoadMany& operator=(const NpyLoadMany&);
+
+        struct Opened {
+            size_t index;
+            int fd;
+        };
+
+        struct Loaded {
+            NpyArray array;
+            std::exception_ptr error;
+        };
+
+        void work();
+
+        std::vector<std::string> fnames;
+        size_t queue_depth;
+        bool in_order;
+        Allocator allocator;
+        std::mutex mutex;
+        std::condition_variable space; //workers wait here for files to open or room to load them
+        std::condition_variable ready; //next() waits here
+        size_t claimed; //files opened, or being opened, so far
+        size_t delivered; //arrays returned by next()
+        std::deque<Opened> opened; //oldest first
+        std::map<size_t, Loaded> loaded;
+        bool stopping;
+        std::vector<std::thread> threads;
+    };
+
+    //every file of fnames in order, through NpyLoadMany
+    std::vector<NpyArray> npy_load_many(const std::vector<std::string>& fnames, size_t queue_depth = 16);
+    //files of one dtype and one C-order shape loaded side by side into a single allocation, as one
+    //array of shape (fnames.size(), shape...). throws if a file's shape or word size differs from the first
+    NpyArray npy_load_stacked(const std::vector<std::string>& fnames, size_t queue_depth = 16);
+    NpyArray npz_load(std::string fname, std::string varname, const NpyAllocator& allocator);
+    NpyArray npz_load_into(std::string fname, std::string varname, void* dst, size_t capacity);
+    NpyArray npy_mmap(std::string fname, bool copy_on_write = false);
+    //npy_load with O_DIRECT, or with the file dropped from the page cache afterwards where O_DIRECT is not supported
+    NpyArray npy_load_direct(std::string fname);
+    //array itself if it is in C order, otherwise a C-order copy made by a cache-blocked transpose
+    NpyArray to_c_order(const NpyArray& array);
+    //npy_load, but Fortran-order files are transposed into C order straight from a mapping of the file
+    NpyArray npy_load_c_order(std::string fname);
+    //rows [start, start+count) of a .npy, reading only those bytes
+    NpyArray npy_load_slice(std::string fname, size_t start, size_t count);
+    //the block of elements offsets[d] + i*strides[d], 0 <= i < extents[d], along every axis d.
+    //empty strides means 1 everywhere. the result keeps the file's memory order.
+    NpyArray npy_load_slice(std::string fname, const std::vector<size_t>& offsets, const std::vector<size_t>& extents,
+                            const std::vector<size_t>& strides = std::vector<size_t>());
+    void npz_write_member(const std::string& zipname, std::string fname, const std::vector<char>& npy_header,
+                          const void* data, size_t data_bytes, const std::string& mode, const NpzCompression& compression);
 
     template<typename T> std::vector<char>& operator+=(std::vector<char>& lhs, const T rhs) {
         //write in little endian
@@ -85,185 +595,736 @@ namespace cnpy {
     template<> std::vector<char>& operator+=(std::vector<char>& lhs, const char* rhs);
 
 
-    template<typename T> void npy_save(std::string fname, const T* data, const std::vector<size_t> shape, std::string mode = "w") {
+    //with fortran_order, data is column-major and is written as it is. appending to such a file grows the last axis
+    //open fname for npy_save and write the header of an array of shape, or of the grown array when
+    //appending to it. returns the file positioned at its end, where the data goes
+    template<typename T> FILE* npy_open_for_save(const std::string& fname, const std::vector<size_t>& shape, const std::string& mode,
+                                                 bool fortran_order) {
         FILE* fp = NULL;
         std::vector<size_t> true_data_shape; //if appending, the shape of existing + new data
 
-        if(mode == "a") fp = fopen(fname.c_str(),"r+b");
+        {
+            CNPY_IO_PHASE(IO_OPEN,0);
+            if(mode == "a") fp = fopen(fname.c_str(),"r+b");
+        }
 
-        if(fp) {
+        bool appending = fp != NULL;
+        if(appending) {
             //file exists. we need to append to it. read the header, modify the array size
             size_t word_size;
-            bool fortran_order;
-            parse_npy_header(fp,word_size,true_data_shape,fortran_order);
-            assert(!fortran_order);
-
+            bool file_fortran_order;
+            try {
+                parse_npy_header(fp,word_size,true_data_shape,file_fortran_order);
+            }
+            catch(...) {
+                fclose(fp);
+                throw;
+            }
+            if(file_fortran_order != fortran_order) {
+                fclose(fp);
+                throw std::runtime_error("npy_save: attempting to append data in the other memory order to "+fname);
+            }
             if(word_size != sizeof(T)) {
-                std::cout<<"libnpy error: "<<fname<<" has word size "<<word_size<<" but npy_save appending data sized "<<sizeof(T)<<"\n";
-                assert( word_size == sizeof(T) );
+                fclose(fp);
+                throw std::runtime_error("npy_save: "+fname+" has word size "+std::to_string(word_size)+
+                                         " but the appended data is sized "+std::to_string(sizeof(T)));
             }
-            if(true_data_shape.size() != shape.size()) {
-                std::cout<<"libnpy error: npy_save attempting to append misdimensioned data to "<<fname<<"\n";
-                assert(true_data_shape.size() != shape.size());
+            if(shape.empty() || true_data_shape.size() != shape.size()) {
+                fclose(fp);
+                throw std::runtime_error("npy_save: attempting to append misdimensioned data to "+fname);
             }
 
-            for(size_t i = 1; i < shape.size(); i++) {
-                if(shape[i] != true_data_shape[i]) {
-                    std::cout<<"libnpy error: npy_save attempting to append misshaped data to "<<fname<<"\n";
-                    assert(shape[i] == true_data_shape[i]);
+            //the slowest varying axis grows: the first in C order, the last in Fortran order
+            size_t grow = fortran_order ? shape.size() - 1 : 0;
+            for(size_t i = 0; i < shape.size(); i++) {
+                if(i != grow && shape[i] != true_data_shape[i]) {
+                    fclose(fp);
+                    throw std::runtime_error("npy_save: attempting to append misshaped data to "+fname);
                 }
             }
-            true_data_shape[0] += shape[0];
+            true_data_shape[grow] += shape[grow];
         }
         else {
+            CNPY_IO_PHASE(IO_OPEN,0);
             fp = fopen(fname.c_str(),"wb");
             true_data_shape = shape;
         }
 
-        std::vector<char> header = create_npy_header<T>(true_data_shape);
-        size_t nels = std::accumulate(shape.begin(),shape.end(),1,std::multiplies<size_t>());
+        const std::vector<char>& header = npy_header_cached<T>(true_data_shape,fortran_order);
 
-        fseek(fp,0,SEEK_SET);
+        //a new file is already positioned for the header, and then for the data
+        CNPY_IO_PHASE(IO_WRITE,header.size());
+        if(appending) fseek(fp,0,SEEK_SET);
         fwrite(&header[0],sizeof(char),header.size(),fp);
-        fseek(fp,0,SEEK_END);
-        fwrite(data,sizeof(T),nels,fp);
+        if(appending) fseek(fp,0,SEEK_END);
+        return fp;
+    }
+
+    template<typename T> void npy_save(const std::string& fname, const T* data, const std::vector<size_t>& shape, const std::string& mode = "w",
+                                       bool fortran_order = false) {
+        FILE* fp = npy_open_for_save<T>(fname,shape,mode,fortran_order);
+        size_t nels = std::accumulate(shape.begin(),shape.end(),(size_t) 1,std::multiplies<size_t>());
+
+        //an empty std::vector has no data() to write from
+        CNPY_IO_PHASE(IO_WRITE,nels*sizeof(T));
+        if(nels > 0) fwrite(data,sizeof(T),nels,fp);
         fclose(fp);
     }
 
-    template<typename T> void npz_save(std::string zipname, std::string fname, const T* data, const std::vector<size_t>& shape, std::string mode = "w")
-    {
-        //first, append a .npy to the fname
-        fname += ".npy";
+    //write the array of shape whose element (i0, i1, ...) is word_size bytes at base + i0*byte_strides[0] + i1*byte_strides[1] + ...
+    //to fp in C order. the elements are gathered into blocks of about block_bytes, and runs that are
+    //contiguous in memory and at least that long are written in place. returns false if a write fails
+    bool write_strided(FILE* fp, const char* base, const std::vector<size_t>& shape, const std::vector<ptrdiff_t>& byte_strides,
+                       size_t word_size, size_t block_bytes = 1 << 20);
 
-        //now, on with the show
-        FILE* fp = NULL;
-        uint16_t nrecs = 0;
-        size_t global_header_offset = 0;
+    //npy_save of a strided view, e.g. one field of an array of structs or a block of a larger
+    //matrix, without copying it to a contiguous array first. byte_strides has one entry per axis
+    //and may be negative; the file is in C order
+    template<typename T> void npy_save_strided(const std::string& fname, const T* base, const std::vector<size_t>& shape,
+                                               const std::vector<ptrdiff_t>& byte_strides, const std::string& mode = "w") {
+        if(byte_strides.size() != shape.size())
+            throw std::runtime_error("npy_save_strided: need one stride per axis for "+fname);
+        FILE* fp = npy_open_for_save<T>(fname,shape,mode,false);
+        bool ok = write_strided(fp,reinterpret_cast<const char*>(base),shape,byte_strides,sizeof(T));
+        if(fclose(fp) != 0 || !ok) throw std::runtime_error("npy_save_strided: failed to write "+fname);
+    }
+
+    //npy_save on the I/O threads. data is not copied: it must stay valid and unchanged until the
+    //future is ready. saves to the same file run in the order they were made
+    template<typename T> std::future<void> npy_save_async(std::string fname, const T* data, const std::vector<size_t>& shape,
+                                                          std::string mode = "w", bool fortran_order = false) {
+        return async_io(fname,[=]() { npy_save(fname,data,shape,mode,fortran_order); });
+    }
+
+    //writes a new file around the page cache. data goes out in aligned chunks with O_DIRECT; where the
+    //file system refuses O_DIRECT, it is written normally and each chunk is flushed with sync_file_range
+    //and dropped from the cache with posix_fadvise once it is on disk. the first header_size bytes
+    //(a multiple of alignment) are reserved for write_header().
+    class NpyDirectFile {
+      public:
+        static const size_t alignment = 4096;
+        static size_t aligned(size_t n) { return (n + alignment - 1) / alignment * alignment; }
+
+        NpyDirectFile(const std::string& fname, size_t header_size, size_t chunk_bytes = 8 << 20);
+        ~NpyDirectFile();
+
+        //append n bytes after what was written before
+        void write(const void* data, size_t n);
+        //header.size() must be header_size
+        void write_header(const std::vector<char>& header);
+        //write what is buffered, cut the file to its real size and close it
+        void close();
+        bool is_direct() const { return direct; }
+
+      private:
+        NpyDirectFile(const NpyDirectFile&);
+        NpyDirectFile& operator=(const NpyDirectFile&);
+
+        void write_at(const char* data, size_t n, size_t offset);
+        void drop_behind(size_t offset, size_t n);
+
+        std::string fname;
+        int fd;
+        bool direct;
+        size_t header_size;
+        std::shared_ptr<NpyStorage> buffer; //aligned, chunk_bytes long
+        size_t fill; //bytes waiting in buffer
+        size_t offset; //where buffer goes in the file
+        size_t pending_offset, pending_bytes; //the last chunk handed to writeback, without O_DIRECT
+    };
+
+    //npy_save for arrays much larger than the page cache, through an NpyDirectFile.
+    //the header is padded to NpyDirectFile::alignment so that the data starts on an aligned offset
+    template<typename T> void npy_save_direct(std::string fname, const T* data, const std::vector<size_t>& shape, bool fortran_order = false) {
+        size_t header_size = NpyDirectFile::aligned(create_npy_header<T>(shape,0,fortran_order).size());
+        std::vector<char> header = create_npy_header<T>(shape,header_size,fortran_order);
+        size_t nels = std::accumulate(shape.begin(),shape.end(),(size_t) 1,std::multiplies<size_t>());
+
+        NpyDirectFile file(fname,header_size);
+        file.write_header(header);
+        file.write(data,nels*sizeof(T));
+        file.close();
+    }
+
+    //keeps a .npy open and appends rows to it, growing the first axis. the header is written with
+    //room for any row count, rows are buffered up to flush_bytes, and the final shape is written
+    //once by close() or the destructor.
+    template<typename T> class NpyWriter {
+      public:
+        //row_shape is the shape of one row, i.e. every axis but the first (empty for a 1-d array).
+        //mode "a" appends to a file previously written by an NpyWriter.
+        //direct writes a new file through an NpyDirectFile instead of stdio, bypassing the page cache
+        NpyWriter(const std::string& _fname, const std::vector<size_t>& row_shape, const std::string& mode = "w", size_t _flush_bytes = 1 << 20,
+                  bool direct = false) :
+            fname(_fname), fp(NULL), header_size(0), flush_bytes(_flush_bytes)
+        {
+            shape.push_back(0);
+            shape.insert(shape.end(),row_shape.begin(),row_shape.end());
+            row_vals = std::accumulate(row_shape.begin(),row_shape.end(),(size_t) 1,std::multiplies<size_t>());
+
+            //the longest header this array can ever need
+            std::vector<size_t> max_shape = shape;
+            max_shape[0] = (size_t) -1;
+            size_t max_header_size = create_npy_header<T>(max_shape).size();
+
+            if(direct) {
+                if(mode == "a") throw std::runtime_error("NpyWriter: direct I/O cannot append to "+fname);
+                header_size = NpyDirectFile::aligned(max_header_size);
+                direct_file.reset(new NpyDirectFile(fname,header_size));
+                write_header();
+                return;
+            }
+
+            if(mode == "a") fp = fopen(fname.c_str(),"r+b");
+
+            if(fp) {
+                size_t word_size;
+                bool fortran_order;
+                std::vector<size_t> file_shape;
+                parse_npy_header(fp,word_size,file_shape,fortran_order);
+                header_size = ftell(fp);
+                if(word_size != sizeof(T) || fortran_order || file_shape.size() != shape.size() ||
+                   !std::equal(shape.begin()+1,shape.end(),file_shape.begin()+1)) {
+                    fclose(fp);
+                    throw std::runtime_error("NpyWriter: "+fname+" does not hold rows of this type and shape");
+                }
+                if(header_size < max_header_size) {
+                    fclose(fp);
+                    throw std::runtime_error("NpyWriter: "+fname+" has no room to grow its header");
+                }
+                shape[0] = file_shape[0];
+                fseek(fp,0,SEEK_END);
+            }
+            else {
+                fp = fopen(fname.c_str(),"wb");
+                if(!fp) throw std::runtime_error("NpyWriter: Unable to open file "+fname);
+                header_size = max_header_size;
+                write_header();
+            }
+            buffer.reserve(flush_bytes);
+        }
+
+        ~NpyWriter() {
+            try { close(); }
+            catch(...) { }
+        }
+
+        void write(const T* data, size_t nrows) {
+            if(!fp && !direct_file) throw std::runtime_error("NpyWriter: "+fname+" is closed");
+            const char* bytes = reinterpret_cast<const char*>(data);
+            size_t nbytes = nrows * row_vals * sizeof(T);
+
+            if(direct_file) {
+                direct_file->write(bytes,nbytes);
+                shape[0] += nrows;
+                return;
+            }
+
+            if(buffer.size() + nbytes > flush_bytes) flush_buffer();
+            if(nbytes >= flush_bytes) {
+                //big enough to skip the buffer
+                CNPY_IO_PHASE(IO_WRITE,nbytes);
+                if(fwrite(bytes,1,nbytes,fp) != nbytes)
+                    throw std::runtime_error("NpyWriter: failed fwrite to "+fname);
+            }
+            else {
+                buffer.insert(buffer.end(),bytes,bytes+nbytes);
+            }
+            shape[0] += nrows;
+        }
+
+        void write(const std::vector<T>& data) {
+            if(row_vals == 0 || data.size() % row_vals != 0)
+                throw std::runtime_error("NpyWriter: data is not a whole number of rows");
+            write(data.data(),data.size() / row_vals);
+        }
+
+        //write the buffered rows and the current shape, leaving the file open.
+        //with direct I/O only the shape is written, rows go out a whole chunk at a time
+        void flush() {
+            if(direct_file) {
+                write_header();
+                return;
+            }
+            if(!fp) return;
+            flush_buffer();
+            write_header();
+            fseek(fp,0,SEEK_END);
+            fflush(fp);
+        }
+
+        void close() {
+            if(direct_file) {
+                write_header();
+                std::unique_ptr<NpyDirectFile> file(std::move(direct_file));
+                file->close();
+                return;
+            }
+            if(!fp) return;
+            flush_buffer();
+            write_header();
+            int err = fclose(fp);
+            fp = NULL;
+            if(err != 0) throw std::runtime_error("NpyWriter: failed to close "+fname);
+        }
+
+        size_t rows() const { return shape[0]; }
+
+      private:
+        NpyWriter(const NpyWriter&);
+        NpyWriter& operator=(const NpyWriter&);
+
+        void flush_buffer() {
+            if(buffer.empty()) return;
+            size_t nbytes = buffer.size();
+            CNPY_IO_PHASE(IO_WRITE,nbytes);
+            size_t written = fwrite(buffer.data(),1,nbytes,fp);
+            buffer.clear();
+            if(written != nbytes)
+                throw std::runtime_error("NpyWriter: failed fwrite to "+fname);
+        }
+
+        void write_header() {
+            std::vector<char> header = create_npy_header<T>(shape,header_size);
+            if(direct_file) {
+                direct_file->write_header(header);
+                return;
+            }
+            fseek(fp,0,SEEK_SET);
+            if(fwrite(header.data(),1,header.size(),fp) != header.size())
+                throw std::runtime_error("NpyWriter: failed to write header of "+fname);
+        }
+
+        std::string fname;
+        FILE* fp;
+        std::vector<size_t> shape;
+        size_t row_vals;
+        size_t header_size;
+        size_t flush_bytes;
+        std::vector<char> buffer;
+        std::unique_ptr<NpyDirectFile> direct_file;
+    };
+
+    //keeps a .npz open for adding members. the central directory is kept in memory and written
+    //once by close() or the destructor, so nothing is rewritten per member. until then the
+    //file on disk has no central directory.
+    class NpzWriter {
+      public:
+        //mode "a" adds to an existing archive, anything else truncates
+        explicit NpzWriter(const std::string& zipname, const std::string& mode = "w");
+        //build the archive in memory, appended to buffer. the buffer is complete after close()
+        explicit NpzWriter(std::vector<char>& buffer);
+        ~NpzWriter();
+
+        template<typename T> void add(const std::string& fname, const T* data, const std::vector<size_t>& shape,
+                                      const NpzCompression& compression = NpzCompression(), bool fortran_order = false) {
+            const std::vector<char>& npy_header = npy_header_cached<T>(shape,fortran_order);
+            size_t nels = std::accumulate(shape.begin(),shape.end(),(size_t) 1,std::multiplies<size_t>());
+            add_member(fname,npy_header,data,nels*sizeof(T),compression);
+        }
+
+        template<typename T> void add(const std::string& fname, const std::vector<T>& data,
+                                      const NpzCompression& compression = NpzCompression()) {
+            std::vector<size_t> shape;
+            shape.push_back(data.size());
+            add(fname,data.data(),shape,compression);
+        }
+
+        //store a C-order array as independent members of chunk_rows rows along axis 0, named by
+        //npz_chunk_name(fname,i), plus a manifest member fname.chunks: a (nchunks, 3) uint64 array of
+        //first row, row count and member crc32. NpzReader reassembles them in parallel or reads only
+        //the chunks a row range touches; npz_unchunk does the same for NumPy.
+        template<typename T> void add_chunked(const std::string& fname, const T* data, const std::vector<size_t>& shape, size_t chunk_rows,
+                                              const NpzCompression& compression = NpzCompression(8)) {
+            if(shape.empty() || chunk_rows == 0) throw std::runtime_error("NpzWriter: add_chunked needs an array with rows and a chunk size");
+            size_t row_vals = std::accumulate(shape.begin()+1,shape.end(),(size_t) 1,std::multiplies<size_t>());
+            size_t nchunks = std::max<size_t>((shape[0] + chunk_rows - 1) / chunk_rows, 1);
+
+            std::vector<uint64_t> manifest;
+            for(size_t i = 0;i < nchunks;i++) {
+                size_t first = i * chunk_rows;
+                std::vector<size_t> chunk_shape = shape;
+                chunk_shape[0] = std::min(chunk_rows, shape[0] - first);
+                std::vector<char> npy_header = create_npy_header<T>(chunk_shape);
+                uint32_t crc = add_member(npz_chunk_name(fname,i),npy_header,data + first*row_vals,chunk_shape[0]*row_vals*sizeof(T),compression);
+                manifest.push_back(first);
+                manifest.push_back(chunk_shape[0]);
+                manifest.push_back(crc);
+            }
+            std::vector<size_t> manifest_shape;
+            manifest_shape.push_back(nchunks);
+            manifest_shape.push_back(3);
+            add(fname + ".chunks",manifest.data(),manifest_shape);
+        }
+
+        //fname without the .npy suffix, npy_header followed by data_bytes of data. returns the crc32 of the member
+        uint32_t add_member(std::string fname, const std::vector<char>& npy_header, const void* data, size_t data_bytes,
+                            const NpzCompression& compression = NpzCompression());
+
+        //write the central directory and footer
+        void close();
+
+      private:
+        NpzWriter(const NpzWriter&);
+        NpzWriter& operator=(const NpzWriter&);
+
+        //append to the archive, and overwrite 4 bytes at offset from its start
+        bool put(const void* data, size_t nbytes);
+        bool patch_u32(size_t offset, uint32_t value, size_t resume);
+
+        std::string zipname;
+        FILE* fp;
+        std::vector<char>* memory; //instead of fp
+        size_t memory_base; //where the archive starts in memory
+        size_t nrecs;
+        size_t global_header_offset; //where the next member, and finally the central directory, goes
         std::vector<char> global_header;
+    };
+
+    template<typename T> void npz_save(const std::string& zipname, const std::string& fname, const T* data, const std::vector<size_t>& shape,
+                                       const std::string& mode = "w", bool fortran_order = false)
+    {
+        const std::vector<char>& npy_header = npy_header_cached<T>(shape,fortran_order);
+        size_t nels = std::accumulate(shape.begin(),shape.end(),(size_t) 1,std::multiplies<size_t>());
+        npz_write_member(zipname,fname,npy_header,data,nels*sizeof(T),mode,NpzCompression());
+    }
+
+    //the same as NpzWriter(zipname,mode).add(fname,data,shape,compression) on the I/O threads.
+    //data must stay valid and unchanged until the future is ready
+    template<typename T> std::future<void> npz_save_async(std::string zipname, std::string fname, const T* data, const std::vector<size_t>& shape,
+                                                          std::string mode = "w", const NpzCompression& compression = NpzCompression()) {
+        return async_io(zipname,[=]() {
+            NpzWriter writer(zipname,mode);
+            writer.add(fname,data,shape,compression);
+            writer.close();
+        });
+    }
+
+    //one stored member of npz_save_all: the .npy header, and data_bytes of data the caller keeps
+    //valid and unchanged until npz_save_all returns
+    struct NpzMemberView {
+        std::string name; //without the .npy suffix
+        std::vector<char> npy_header;
+        const void* data;
+        size_t data_bytes;
+    };
+
+    template<typename T> NpzMemberView npz_member(const std::string& name, const T* data, const std::vector<size_t>& shape,
+                                                  bool fortran_order = false) {
+        NpzMemberView m;
+        m.name = name;
+        m.npy_header = npy_header_cached<T>(shape,fortran_order);
+        m.data = data;
+        m.data_bytes = std::accumulate(shape.begin(),shape.end(),(size_t) 1,std::multiplies<size_t>()) * sizeof(T);
+        return m;
+    }
 
-        if(mode == "a") fp = fopen(zipname.c_str(),"r+b");
-
-        if(fp) {
-            //zip file exists. we need to add a new npy file to it.
-            //first read the footer. this gives us the offset and size of the global header
-            //then read and store the global header.
-            //below, we will write the the new data at the start of the global header then append the global header and footer below it
-            size_t global_header_size;
-            parse_zip_footer(fp,nrecs,global_header_size,global_header_offset);
-            fseek(fp,global_header_offset,SEEK_SET);
-            global_header.resize(global_header_size);
-            size_t res = fread(&global_header[0],sizeof(char),global_header_size,fp);
-            if(res != global_header_size){
-                throw std::runtime_error("npz_save: header read error while adding to existing zip");
+    //write a new archive of stored members in one go. every offset is known up front, so the file is
+    //allocated at its final size and nthreads threads (0 = one per core) pwrite and checksum pieces of
+    //all members at once; the local headers and central directory follow once the crcs are known.
+    //the bytes are the same as NpzWriter writes for the same members
+    void npz_save_all(const std::string& zipname, const std::vector<NpzMemberView>& members, unsigned nthreads = 0);
+
+    //NpyWriter with two buffers: rows are copied into one while the other is written out on the
+    //I/O threads, so write() only waits when the disk falls a whole buffer behind.
+    //write errors surface from the next write(), flush() or close().
+    template<typename T> class NpyAsyncWriter {
+      public:
+        NpyAsyncWriter(const std::string& _fname, const std::vector<size_t>& row_shape, const std::string& mode = "w", size_t buffer_bytes = 1 << 22) :
+            fname(_fname), writer(_fname,row_shape,mode,0), nrows(0)
+        {
+            row_vals = std::accumulate(row_shape.begin(),row_shape.end(),(size_t) 1,std::multiplies<size_t>());
+            if(row_vals == 0) throw std::runtime_error("NpyAsyncWriter: rows of "+fname+" have no values");
+            capacity = std::max<size_t>(buffer_bytes / sizeof(T), row_vals);
+            front.reserve(capacity);
+            back.reserve(capacity);
+        }
+
+        ~NpyAsyncWriter() {
+            try { close(); }
+            catch(...) { }
+        }
+
+        void write(const T* data, size_t n) {
+            front.insert(front.end(),data,data + n*row_vals);
+            nrows += n;
+            if(front.size() >= capacity) drain();
+        }
+
+        void write(const std::vector<T>& data) {
+            if(data.size() % row_vals != 0)
+                throw std::runtime_error("NpyAsyncWriter: data is not a whole number of rows");
+            write(data.data(),data.size() / row_vals);
+        }
+
+        //start writing out what is buffered and wait for it to reach the file
+        void flush() {
+            if(!front.empty()) drain();
+            wait();
+        }
+
+        void close() {
+            flush();
+            writer.close();
+        }
+
+        size_t rows() const { return nrows; }
+
+      private:
+        NpyAsyncWriter(const NpyAsyncWriter&);
+        NpyAsyncWriter& operator=(const NpyAsyncWriter&);
+
+        void wait() {
+            if(pending.valid()) pending.get();
+        }
+
+        void drain() {
+            wait();
+            front.swap(back);
+            front.clear();
+            pending = async_io(fname,[this]() { writer.write(back.data(),back.size() / row_vals); });
+        }
+
+        std::string fname;
+        NpyWriter<T> writer; //only used by the I/O task in flight, or after wait()
+        std::vector<T> front, back;
+        std::future<void> pending;
+        size_t row_vals;
+        size_t capacity; //values per buffer
+        size_t nrows;
+    };
+
+    //the hand-over from producer threads to the one I/O thread of a concurrent writer. push() never
+    //waits for the I/O thread: batches go on a lock-free list, which the thread takes whole and
+    //passes to consume in the order they were pushed. consume runs on the I/O thread only
+    class ConcurrentSink {
+      public:
+        //name and header_bytes are passed through from push()
+        typedef std::function<void(const std::string& name, std::vector<char>& batch, size_t header_bytes)> Consumer;
+
+        explicit ConcurrentSink(const Consumer& consume);
+        ~ConcurrentSink();
+
+        //take over the contents of batch, leaving it empty
+        void push(const std::string& name, std::vector<char>& batch, size_t header_bytes = 0);
+        //consume every batch pushed so far and stop the I/O thread. rethrows the first error consume threw,
+        //after which the remaining batches are dropped
+        void close();
+
+      private:
+        ConcurrentSink(const ConcurrentSink&);
+        ConcurrentSink& operator=(const ConcurrentSink&);
+
+        struct Batch {
+            std::string name;
+            std::vector<char> data;
+            size_t header_bytes;
+            Batch* next;
+        };
+        void run();
+
+        Consumer consume;
+        std::atomic<Batch*> head; //newest first
+        std::atomic<bool> closing;
+        std::mutex wake_mutex;
+        std::condition_variable wake;
+        std::exception_ptr error;
+        std::thread thread;
+    };
+
+    //many threads appending rows to one .npy, as the worker threads of a Geant4 run do. each thread
+    //writes through its own Producer, which stages rows without any locking and hands them on a batch
+    //of batch_bytes at a time; one I/O thread appends the batches with an NpyWriter, growing axis 0.
+    //rows from different producers interleave a batch at a time. producers never wait for the disk, so
+    //memory grows if they outpace it. destroy or flush() every Producer before close()
+    template<typename T> class NpyConcurrentWriter {
+      public:
+        class Producer {
+          public:
+            explicit Producer(NpyConcurrentWriter& _owner) : owner(_owner) { }
+            ~Producer() {
+                try { flush(); }
+                catch(...) { }
+            }
+
+            void write(const T* rows, size_t nrows) {
+                const char* bytes = reinterpret_cast<const char*>(rows);
+                size_t nbytes = nrows * owner.row_vals * sizeof(T);
+                if(batch.capacity() == 0) batch.reserve(std::max(owner.batch_bytes, nbytes));
+                batch.insert(batch.end(),bytes,bytes + nbytes);
+                if(batch.size() >= owner.batch_bytes) flush();
+            }
+
+            //hand the staged rows to the I/O thread now
+            void flush() {
+                if(!batch.empty()) owner.sink.push(std::string(),batch);
             }
-            fseek(fp,global_header_offset,SEEK_SET);
+
+          private:
+            Producer(const Producer&);
+            Producer& operator=(const Producer&);
+
+            NpyConcurrentWriter& owner;
+            std::vector<char> batch;
+        };
+
+        NpyConcurrentWriter(const std::string& fname, const std::vector<size_t>& row_shape, const std::string& mode = "w",
+                            size_t _batch_bytes = 1 << 20) :
+            writer(fname,row_shape,mode), row_vals(std::accumulate(row_shape.begin(),row_shape.end(),(size_t) 1,std::multiplies<size_t>())),
+            batch_bytes(_batch_bytes), sink([this](const std::string&, std::vector<char>& batch, size_t) {
+                writer.write(reinterpret_cast<const T*>(batch.data()),batch.size() / (row_vals * sizeof(T)));
+            }) { }
+
+        ~NpyConcurrentWriter() {
+            try { close(); }
+            catch(...) { }
         }
-        else {
-            fp = fopen(zipname.c_str(),"wb");
+
+        //write out every batch handed over so far and close the file
+        void close() {
+            sink.close();
+            writer.close();
         }
 
+        //rows written, once closed
+        size_t rows() const { return writer.rows(); }
+
+      private:
+        NpyConcurrentWriter(const NpyConcurrentWriter&);
+        NpyConcurrentWriter& operator=(const NpyConcurrentWriter&);
+
+        NpyWriter<T> writer; //only used by the I/O thread until close()
+        size_t row_vals;
+        size_t batch_bytes;
+        ConcurrentSink sink;
+    };
+
+    //the same for .npz: add() may be called from any number of threads at once. it copies the array
+    //and returns, and the I/O thread writes it as member fname, compressed as given
+    class NpzConcurrentWriter {
+      public:
+        explicit NpzConcurrentWriter(const std::string& zipname, const std::string& mode = "w",
+                                     const NpzCompression& compression = NpzCompression());
+        ~NpzConcurrentWriter();
+
+        template<typename T> void add(const std::string& fname, const T* data, const std::vector<size_t>& shape, bool fortran_order = false) {
+            std::vector<char> member = create_npy_header<T>(shape,0,fortran_order);
+            size_t header_bytes = member.size();
+            size_t nels = std::accumulate(shape.begin(),shape.end(),(size_t) 1,std::multiplies<size_t>());
+            const char* bytes = reinterpret_cast<const char*>(data);
+            member.insert(member.end(),bytes,bytes + nels*sizeof(T));
+            sink.push(fname,member,header_bytes);
+        }
+
+        //write every member added so far and the central directory
+        void close();
+
+      private:
+        NpzConcurrentWriter(const NpzConcurrentWriter&);
+        NpzConcurrentWriter& operator=(const NpzConcurrentWriter&);
+
+        NpzWriter writer; //only used by the I/O thread until close()
+        NpzCompression compression;
+        ConcurrentSink sink;
+    };
+
+    //like npz_save, but deflates the member (np.savez_compressed). level is a zlib level,
+    //nthreads = 0 uses every core for arrays larger than one compression block.
+    template<typename T> void npz_save_compressed(const std::string& zipname, const std::string& fname, const T* data, const std::vector<size_t>& shape,
+                                                  const std::string& mode = "w", int level = Z_DEFAULT_COMPRESSION, unsigned nthreads = 0)
+    {
         std::vector<char> npy_header = create_npy_header<T>(shape);
+        size_t nels = std::accumulate(shape.begin(),shape.end(),(size_t) 1,std::multiplies<size_t>());
+        npz_write_member(zipname,fname,npy_header,data,nels*sizeof(T),mode,NpzCompression(8,level,nthreads));
+    }
 
-        size_t nels = std::accumulate(shape.begin(),shape.end(),1,std::multiplies<size_t>());
-        size_t nbytes = nels*sizeof(T) + npy_header.size();
-
-        //get the CRC of the data to be added
-        uint32_t crc = crc32(0L,(uint8_t*)&npy_header[0],npy_header.size());
-        crc = crc32(crc,(uint8_t*)data,nels*sizeof(T));
-
-        //build the local header
-        std::vector<char> local_header;
-        local_header += "PK"; //first part of sig
-        local_header += (uint16_t) 0x0403; //second part of sig
-        local_header += (uint16_t) 20; //min version to extract
-        local_header += (uint16_t) 0; //general purpose bit flag
-        local_header += (uint16_t) 0; //compression method
-        local_header += (uint16_t) 0; //file last mod time
-        local_header += (uint16_t) 0;     //file last mod date
-        local_header += (uint32_t) crc; //crc
-        local_header += (uint32_t) nbytes; //compressed size
-        local_header += (uint32_t) nbytes; //uncompressed size
-        local_header += (uint16_t) fname.size(); //fname length
-        local_header += (uint16_t) 0; //extra field length
-        local_header += fname;
-
-        //build global header
-        global_header += "PK"; //first part of sig
-        global_header += (uint16_t) 0x0201; //second part of sig
-        global_header += (uint16_t) 20; //version made by
-        global_header.insert(global_header.end(),local_header.begin()+4,local_header.begin()+30);
-        global_header += (uint16_t) 0; //file comment length
-        global_header += (uint16_t) 0; //disk number where file starts
-        global_header += (uint16_t) 0; //internal file attributes
-        global_header += (uint32_t) 0; //external file attributes
-        global_header += (uint32_t) global_header_offset; //relative offset of local file header, since it begins where the global header used to begin
-        global_header += fname;
-
-        //build footer
-        std::vector<char> footer;
-        footer += "PK"; //first part of sig
-        footer += (uint16_t) 0x0605; //second part of sig
-        footer += (uint16_t) 0; //number of this disk
-        footer += (uint16_t) 0; //disk where footer starts
-        footer += (uint16_t) (nrecs+1); //number of records on this disk
-        footer += (uint16_t) (nrecs+1); //total number of records
-        footer += (uint32_t) global_header.size(); //nbytes of global headers
-        footer += (uint32_t) (global_header_offset + nbytes + local_header.size()); //offset of start of global headers, since global header now starts after newly written array
-        footer += (uint16_t) 0; //zip file comment length
-
-        //write everything
-        fwrite(&local_header[0],sizeof(char),local_header.size(),fp);
-        fwrite(&npy_header[0],sizeof(char),npy_header.size(),fp);
-        fwrite(data,sizeof(T),nels,fp);
-        fwrite(&global_header[0],sizeof(char),global_header.size(),fp);
-        fwrite(&footer[0],sizeof(char),footer.size(),fp);
-        fclose(fp);
+    //the vector overloads take data by reference and never copy it
+    template<typename T> void npy_save(const std::string& fname, const std::vector<T>& data, const std::string& mode = "w") {
+        std::vector<size_t> shape;
+        shape.push_back(data.size());
+        npy_save(fname, data.data(), shape, mode);
     }
 
-    template<typename T> void npy_save(std::string fname, const std::vector<T> data, std::string mode = "w") {
+    template<typename T> void npz_save(const std::string& zipname, const std::string& fname, const std::vector<T>& data, const std::string& mode = "w") {
         std::vector<size_t> shape;
         shape.push_back(data.size());
-        npy_save(fname, &data[0], shape, mode);
+        npz_save(zipname, fname, data.data(), shape, mode);
     }
 
-    template<typename T> void npz_save(std::string zipname, std::string fname, const std::vector<T> data, std::string mode = "w") {
+    template<typename T> void npz_save_compressed(const std::string& zipname, const std::string& fname, const std::vector<T>& data,
+                                                  const std::string& mode = "w", int level = Z_DEFAULT_COMPRESSION, unsigned nthreads = 0) {
         std::vector<size_t> shape;
         shape.push_back(data.size());
-        npz_save(zipname, fname, &data[0], shape, mode);
+        npz_save_compressed(zipname, fname, data.data(), shape, mode, level, nthreads);
+    }
+
+    //in-memory .npy, e.g. as a wire format. the bytes are exactly those of a .npy file
+    template<typename T> size_t npy_serialized_size(const std::vector<size_t>& shape, bool fortran_order = false) {
+        size_t nels = std::accumulate(shape.begin(),shape.end(),(size_t) 1,std::multiplies<size_t>());
+        return npy_header_cached<T>(shape,fortran_order).size() + nels*sizeof(T);
+    }
+
+    //append the .npy of data to buffer, growing it once by exactly npy_serialized_size() bytes
+    template<typename T> void npy_serialize(std::vector<char>& buffer, const T* data, const std::vector<size_t>& shape,
+                                            bool fortran_order = false) {
+        const std::vector<char>& header = npy_header_cached<T>(shape,fortran_order);
+        size_t nels = std::accumulate(shape.begin(),shape.end(),(size_t) 1,std::multiplies<size_t>());
+        const char* bytes = reinterpret_cast<const char*>(data);
+        buffer.reserve(buffer.size() + header.size() + nels*sizeof(T));
+        buffer.insert(buffer.end(),header.begin(),header.end());
+        buffer.insert(buffer.end(),bytes,bytes + nels*sizeof(T));
+    }
+
+    //append a one-member .npz to buffer. use NpzWriter(buffer) for more members
+    template<typename T> void npz_serialize(std::vector<char>& buffer, const std::string& fname, const T* data, const std::vector<size_t>& shape,
+                                            const NpzCompression& compression = NpzCompression()) {
+        NpzWriter writer(buffer);
+        writer.add(fname,data,shape,compression);
+        writer.close();
     }
 
-    template<typename T> std::vector<char> create_npy_header(const std::vector<size_t>& shape) {  
-
-        std::vector<char> dict;
-        dict += "{'descr': '";
-        dict += BigEndianTest();
-        dict += map_type(typeid(T));
-        dict += std::to_string(sizeof(T));
-        dict += "', 'fortran_order': False, 'shape': (";
-        dict += std::to_string(shape[0]);
-        for(size_t i = 1;i < shape.size();i++) {
-            dict += ", ";
-            dict += std::to_string(shape[i]);
-        }
-        if(shape.size() == 1) dict += ",";
-        dict += "), }";
-        //pad with spaces so that preamble+dict is modulo 16 bytes. preamble is 10 bytes. dict needs to end with \n
-        int remainder = 16 - (10 + dict.size()) % 16;
-        dict.insert(dict.end(),remainder,' ');
-        dict.back() = '\n';
-
-        std::vector<char> header;
-        header += (char) 0x93;
-        header += "NUMPY";
-        header += (char) 0x01; //major version of numpy format
-        header += (char) 0x00; //minor version of numpy format
-        header += (uint16_t) dict.size();
-        header.insert(header.end(),dict.begin(),dict.end());
+    //the exact size of an archive of the stored members (see npz_member), as NpzWriter(buffer) writes
+    //it, for reserving the buffer up front. the padding that aligns each member's data depends on
+    //the size of its npy header
+    size_t npz_stored_size(const std::vector<NpzMemberView>& members);
+
+    //a view of the .npy in buffer, without copying it. the header is checked against size, and the
+    //buffer must outlive the array
+    NpyArray npy_deserialize(const void* buffer, size_t size);
+    //the same for a buffer the array keeps alive
+    NpyArray npy_deserialize(const std::shared_ptr<NpyStorage>& buffer);
+    //an NpzMap of the .npz in buffer: stored members are views into it, deflated ones are decompressed
+    NpzMap npz_open_memory(const void* buffer, size_t size, bool verify_crc = false);
 
+    //header_size = 0 pads the header to the next multiple of 16 bytes. otherwise the header is
+    //padded to exactly header_size bytes, which lets a later header with a longer shape overwrite it.
+    template<typename T> std::vector<char> create_npy_header(const std::vector<size_t>& shape, size_t header_size, bool fortran_order) {
+        const std::string& descr = NpyDescr<T>::get();
+        char buffer[256];
+        size_t n = write_npy_header(buffer,sizeof(buffer),descr.data(),descr.size(),shape.data(),shape.size(),fortran_order,header_size);
+        if(n <= sizeof(buffer)) return std::vector<char>(buffer,buffer + n);
+
+        std::vector<char> header(n);
+        write_npy_header(header.data(),n,descr.data(),descr.size(),shape.data(),shape.size(),fortran_order,header_size);
         return header;
     }
 
 
 }
 
+//the field descriptions for CNPY_RECORD, e.g.
+//CNPY_RECORD(Hit, CNPY_FIELD(Hit, energy), CNPY_FIELD(Hit, pos), CNPY_FIELD(Hit, id))
+#define CNPY_FIELD(Struct, member) cnpy::npy_field<decltype(((Struct*) 0)->member)>(#member, offsetof(Struct, member))
+
+#define CNPY_RECORD(Struct, ...) \
+    namespace cnpy { \
+        template<> struct NpyRecord<Struct> { \
+            static const bool defined = true; \
+            static std::vector<NpyField> fields() { \
+                NpyField f[] = {__VA_ARGS__}; \
+                return std::vector<NpyField>(f, f + sizeof(f) / sizeof(f[0])); \
+            } \
+        }; \
+    }
+
 #endif
@@ -0,0 +1,307 @@
+//Throughput and latency of the cnpy save and load paths, written as JSON or CSV.
+//usage: cnpy_bench [--dir D] [--sizes 1K,1M,64M] [--repeat N] [--cache warm|cold|both]
+//                  [--small-files N] [--small-size S] [--sync] [--format json|csv]
+//sizes take K, M and G suffixes (powers of 1024). cold cache runs flush each file and drop it
+//from the page cache with posix_fadvise before it is read, which needs no privileges.
+
+#include"cnpy.h"
+#include<algorithm>
+#include<chrono>
+#include<cstdio>
+#include<cstdlib>
+#include<fcntl.h>
+#include<unistd.h>
+#include<string>
+#include<vector>
+
+namespace {
+
+struct Options {
+    std::string dir;
+    std::vector<size_t> sizes;
+    size_t repeat;
+    bool warm;
+    bool cold;
+    size_t small_files;
+    size_t small_size;
+    bool sync;
+    bool csv;
+};
+
+struct Result {
+    std::string op;
+    std::string layout; //one_file or many_files
+    std::string compression; //stored or deflate
+    std::string cache; //warm or cold, for loads
+    size_t bytes; //payload bytes moved per run, over all files
+    size_t files;
+    std::vector<double> seconds;
+};
+
+Options options;
+std::vector<Result> results;
+
+size_t parse_size(const std::string& s) {
+    char* end;
+    double value = strtod(s.c_str(),&end);
+    switch(*end) {
+        case 'G': case 'g': value *= 1024;
+        //fall through
+        case 'M': case 'm': value *= 1024;
+        //fall through
+        case 'K': case 'k': value *= 1024;
+    }
+    return (size_t) value;
+}
+
+std::vector<size_t> parse_sizes(const std::string& list) {
+    std::vector<size_t> sizes;
+    size_t start = 0;
+    while(start <= list.size()) {
+        size_t comma = list.find(',',start);
+        if(comma == std::string::npos) comma = list.size();
+        if(comma > start) sizes.push_back(parse_size(list.substr(start,comma-start)));
+        start = comma + 1;
+    }
+    return sizes;
+}
+
+double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//write back any dirty pages, so a save is timed to the disk and not to the page cache
+void sync_file(const std::string& fname) {
+    int fd = open(fname.c_str(),O_RDONLY);
+    if(fd < 0) return;
+    fdatasync(fd);
+    close(fd);
+}
+
+void drop_from_cache(const std::string& fname) {
+    int fd = open(fname.c_str(),O_RDONLY);
+    if(fd < 0) return;
+    fdatasync(fd);
+    posix_fadvise(fd,0,0,POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+//repeat the timed part of a case. prepare runs untimed before each repetition
+template<typename Prepare, typename Run>
+void measure(Result result, Prepare prepare, Run run) {
+    for(size_t i = 0;i < options.repeat;i++) {
+        prepare();
+        double start = now();
+        run();
+        result.seconds.push_back(now() - start);
+    }
+    results.push_back(result);
+    fprintf(stderr,"%-22s %-10s %-8s %-5s %14zu bytes %8.4f s\n",result.op.c_str(),result.layout.c_str(),
+            result.compression.c_str(),result.cache.c_str(),result.bytes,result.seconds.back());
+}
+
+Result make_result(const std::string& op, const std::string& compression, const std::string& cache, size_t bytes, size_t files = 1) {
+    Result r;
+    r.op = op;
+    r.layout = files > 1 ? "many_files" : "one_file";
+    r.compression = compression;
+    r.cache = cache;
+    r.bytes = bytes;
+    r.files = files;
+    return r;
+}
+
+//pseudo-random values on a coarse grid, so deflate has some but not trivial redundancy to find
+std::vector<double> make_data(size_t nvals) {
+    std::vector<double> data(nvals);
+    uint32_t x = 12345;
+    for(size_t i = 0;i < nvals;i++) {
+        x = x * 1664525u + 1013904223u;
+        data[i] = (double) (x >> 22) * 0.25;
+    }
+    return data;
+}
+
+void nothing() { }
+
+std::vector<std::string> load_caches() {
+    std::vector<std::string> caches;
+    if(options.warm) caches.push_back("warm");
+    if(options.cold) caches.push_back("cold");
+    return caches;
+}
+
+void bench_size(size_t bytes) {
+    size_t nvals = std::max<size_t>(bytes / sizeof(double), 1);
+    bytes = nvals * sizeof(double);
+    std::vector<double> data = make_data(nvals);
+    const double* p = data.data();
+    std::vector<size_t> shape(1,nvals);
+    std::string npy = options.dir + "/cnpy_bench.npy";
+    std::string npz = options.dir + "/cnpy_bench.npz";
+    std::string npzc = options.dir + "/cnpy_bench_compressed.npz";
+    bool sync = options.sync;
+
+    measure(make_result("npy_save","stored","",bytes),nothing,[&]() {
+        cnpy::npy_save(npy,p,shape);
+        if(sync) sync_file(npy);
+    });
+    measure(make_result("npy_save_append","stored","",bytes),[&]() { cnpy::npy_save(npy,p,shape); },[&]() {
+        cnpy::npy_save(npy,p,shape,"a");
+        if(sync) sync_file(npy);
+    });
+    measure(make_result("npz_save","stored","",bytes),nothing,[&]() {
+        cnpy::npz_save(npz,"a",p,shape);
+        if(sync) sync_file(npz);
+    });
+    measure(make_result("npz_save_append","stored","",bytes),[&]() { cnpy::npz_save(npz,"a",p,shape); },[&]() {
+        cnpy::npz_save(npz,"b",p,shape,"a");
+        if(sync) sync_file(npz);
+    });
+    measure(make_result("npz_save","deflate","",bytes),nothing,[&]() {
+        cnpy::npz_save_compressed(npzc,"a",p,shape);
+        if(sync) sync_file(npzc);
+    });
+    measure(make_result("npz_save_append","deflate","",bytes),[&]() { cnpy::npz_save_compressed(npzc,"a",p,shape); },[&]() {
+        cnpy::npz_save_compressed(npzc,"b",p,shape,"a");
+        if(sync) sync_file(npzc);
+    });
+
+    //npy holds one array, each npz two members "a" and "b" from the append cases
+    std::vector<std::string> caches = load_caches();
+    for(size_t c = 0;c < caches.size();c++) {
+        bool cold = caches[c] == "cold";
+        std::string npy_file = npy, npz_files[2] = {npz, npzc};
+        measure(make_result("npy_load","stored",caches[c],2*bytes),[&]() { if(cold) drop_from_cache(npy_file); },[&]() {
+            cnpy::npy_load(npy_file);
+        });
+        for(size_t z = 0;z < 2;z++) {
+            std::string f = npz_files[z];
+            std::string compression = z ? "deflate" : "stored";
+            measure(make_result("npz_load",compression,caches[c],2*bytes),[&]() { if(cold) drop_from_cache(f); },[&]() {
+                cnpy::npz_load(f);
+            });
+            measure(make_result("npz_load_varname",compression,caches[c],bytes),[&]() { if(cold) drop_from_cache(f); },[&]() {
+                cnpy::npz_load(f,"b");
+            });
+        }
+    }
+    remove(npy.c_str());
+    remove(npz.c_str());
+    remove(npzc.c_str());
+}
+
+//the same payload as many small .npy files and as one file
+void bench_small_files() {
+    size_t nfiles = options.small_files;
+    size_t nvals = std::max<size_t>(options.small_size / sizeof(double), 1);
+    size_t bytes = nvals * sizeof(double);
+    std::vector<double> data = make_data(nvals * nfiles);
+    std::vector<std::string> fnames;
+    for(size_t i = 0;i < nfiles;i++) fnames.push_back(options.dir+"/cnpy_bench_small_"+std::to_string(i)+".npy");
+    std::string big = options.dir + "/cnpy_bench_big.npy";
+
+    measure(make_result("npy_save","stored","",bytes*nfiles,nfiles),nothing,[&]() {
+        for(size_t i = 0;i < nfiles;i++) {
+            cnpy::npy_save(fnames[i],&data[i*nvals],std::vector<size_t>(1,nvals));
+            if(options.sync) sync_file(fnames[i]);
+        }
+    });
+    measure(make_result("npy_save","stored","",bytes*nfiles),nothing,[&]() {
+        cnpy::npy_save(big,data.data(),std::vector<size_t>(1,nvals*nfiles));
+        if(options.sync) sync_file(big);
+    });
+
+    std::vector<std::string> caches = load_caches();
+    for(size_t c = 0;c < caches.size();c++) {
+        bool cold = caches[c] == "cold";
+        measure(make_result("npy_load","stored",caches[c],bytes*nfiles,nfiles),[&]() {
+            if(cold) for(size_t i = 0;i < nfiles;i++) drop_from_cache(fnames[i]);
+        },[&]() {
+            for(size_t i = 0;i < nfiles;i++) cnpy::npy_load(fnames[i]);
+        });
+        measure(make_result("npy_load_many","stored",caches[c],bytes*nfiles,nfiles),[&]() {
+            if(cold) for(size_t i = 0;i < nfiles;i++) drop_from_cache(fnames[i]);
+        },[&]() {
+            cnpy::npy_load_many(fnames);
+        });
+        measure(make_result("npy_load","stored",caches[c],bytes*nfiles),[&]() { if(cold) drop_from_cache(big); },[&]() {
+            cnpy::npy_load(big);
+        });
+    }
+
+    for(size_t i = 0;i < nfiles;i++) remove(fnames[i].c_str());
+    remove(big.c_str());
+}
+
+double median(std::vector<double> v) {
+    std::sort(v.begin(),v.end());
+    size_t n = v.size();
+    return n % 2 ? v[n/2] : 0.5 * (v[n/2-1] + v[n/2]);
+}
+
+void print_results() {
+    if(options.csv) printf("op,layout,compression,cache,bytes,files,repeat,median_s,min_s,mb_per_s,us_per_file\n");
+    else printf("[\n");
+    for(size_t i = 0;i < results.size();i++) {
+        const Result& r = results[i];
+        double med = median(r.seconds);
+        double best = *std::min_element(r.seconds.begin(),r.seconds.end());
+        double mbps = med > 0 ? r.bytes / med / 1e6 : 0;
+        double us_per_file = med / r.files * 1e6;
+        if(options.csv) {
+            printf("%s,%s,%s,%s,%zu,%zu,%zu,%.9f,%.9f,%.3f,%.3f\n",r.op.c_str(),r.layout.c_str(),r.compression.c_str(),
+                   r.cache.c_str(),r.bytes,r.files,r.seconds.size(),med,best,mbps,us_per_file);
+        }
+        else {
+            printf("  {\"op\": \"%s\", \"layout\": \"%s\", \"compression\": \"%s\", \"cache\": \"%s\", \"bytes\": %zu, \"files\": %zu, "
+                   "\"repeat\": %zu, \"median_s\": %.9f, \"min_s\": %.9f, \"mb_per_s\": %.3f, \"us_per_file\": %.3f}%s\n",
+                   r.op.c_str(),r.layout.c_str(),r.compression.c_str(),r.cache.c_str(),r.bytes,r.files,r.seconds.size(),
+                   med,best,mbps,us_per_file,i + 1 < results.size() ? "," : "");
+        }
+    }
+    if(!options.csv) printf("]\n");
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    options.dir = ".";
+    options.sizes = parse_sizes("1K,64K,1M,16M,256M");
+    options.repeat = 3;
+    options.warm = options.cold = true;
+    options.small_files = 1000;
+    options.small_size = 4096;
+    options.sync = false;
+    options.csv = false;
+
+    for(int i = 1;i < argc;i++) {
+        std::string arg = argv[i];
+        std::string value = i + 1 < argc ? argv[i+1] : "";
+        if(arg == "--sync") { options.sync = true; continue; }
+        if(value.empty()) {
+            fprintf(stderr,"cnpy_bench: %s needs a value\n",arg.c_str());
+            return 1;
+        }
+        i++;
+        if(arg == "--dir") options.dir = value;
+        else if(arg == "--sizes") options.sizes = parse_sizes(value);
+        else if(arg == "--repeat") options.repeat = std::max<size_t>(strtoul(value.c_str(),NULL,10),1);
+        else if(arg == "--cache") {
+            options.warm = value != "cold";
+            options.cold = value != "warm";
+        }
+        else if(arg == "--small-files") options.small_files = strtoul(value.c_str(),NULL,10);
+        else if(arg == "--small-size") options.small_size = parse_size(value);
+        else if(arg == "--format") options.csv = value == "csv";
+        else {
+            fprintf(stderr,"cnpy_bench: unknown option %s\n",arg.c_str());
+            return 1;
+        }
+    }
+
+    for(size_t i = 0;i < options.sizes.size();i++) bench_size(options.sizes[i]);
+    if(options.small_files > 0) bench_small_files();
+    print_results();
+}